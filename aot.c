@@ -21,188 +21,1851 @@
  * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
 #include <err.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <libgccjit.h>
 #include <libgen.h>
+#include <limits.h>
+#include <link.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
-#define READ_SIZE 1024 * 8
-#define MAX_FILE_SIZE 1024 * 1024 * 8
-#define TAPE_SIZE 30000
-#define STACK_SIZE 256
-
-#define IS_EMPTY_STACK(stack) (stack.len == 0)
-#define PUSH_STACK(stack, start, end)                                          \
-  do {                                                                         \
-    if (stack.len == STACK_SIZE)                                               \
-      errx(EXIT_FAILURE, "Nested loops exceeded stack size");                  \
-    stack.data[stack.len++] = (jmp_pair){ start, end };                        \
-  } while (0)
-#define POP_STACK(stack) (stack.len--)
-#define TOP_START(stack) (stack.data[stack.len - 1].start)
-#define TOP_END(stack) (stack.data[stack.len - 1].end)
+#include "ir.h"
+#include "probes.h"
+#include "rt.h"
+#include "stats.h"
+
+#define READ_SIZE 1024 * 8
+#define MAX_FILE_SIZE 1024 * 1024 * 8
+#define TAPE_SIZE 30000
+
+#define AUTO_OPT_LEVEL -1
+#define MAX_OPTIONS 1024
+#define MAX_JOBS 256
+
+#define MAX_SCALAR_CELLS 64
+#define OUTLINE_MIN_OPS 16
+
+// Bump when generated code changes for the same IR, to invalidate caches
+#define CODEGEN_VERSION 1
+
+#define PREFIX_STEPS 10000000
+#define PREFIX_MAX_OUTPUT (1 << 24)
+
+#define LIKELY_RATIO 0.9
+#define UNROLL_MIN_TRIPS 8
+#define UNROLL_MIN_BACKEDGES 1000
+#define UNROLL_MAX_OPS 16
+
+typedef struct {
+  gcc_jit_lvalue *in, *out;
+  gcc_jit_field *pos, *len, *total, *data;
+  gcc_jit_function *flush, *fill, *write;
+  gcc_jit_lvalue *progress, *backedges;
+  gcc_jit_function *report, *watch;
+} runtime;
+
+typedef struct {
+  gcc_jit_context *ctx;
+  gcc_jit_function *fn;
+  gcc_jit_type *int_type, *cell_type;
+  gcc_jit_rvalue *tape;
+  gcc_jit_lvalue *index;
+  runtime *rt;
+  gcc_jit_rvalue *get, *put, *io;
+  profile_t *profile;
+  gcc_jit_function *expect;
+  gcc_jit_location **locs, *loc;
+  size_t *loop_ids;
+  gcc_jit_function **outlined;
+  gcc_jit_lvalue **cells;
+  size_t ncells;
+  ssize_t base, pos;
+} codegen;
+
+typedef struct {
+  uint8_t tape[TAPE_SIZE];
+  ssize_t index;
+  size_t pc;
+  uint8_t *output;
+  size_t len, cap;
+} prefix;
+
+typedef enum { OUTPUT_EXECUTABLE, OUTPUT_OBJECT, OUTPUT_LIBRARY } output_kind;
+
+typedef void (*BF_program)(uint8_t *);
+typedef int (*BF_chunk)(uint8_t *, int);
+
+static const char *progname;
+
+static struct option longopts[] = {
+  {"help",           no_argument,       NULL, 'h'},
+  { "cache",         optional_argument, NULL, 'c'},
+  { "perf-counters", optional_argument, NULL, 'C'},
+  { "dump",          no_argument,       NULL, 'd'},
+  { "outdir",        required_argument, NULL, 'D'},
+  { "execute",       no_argument,       NULL, 'e'},
+  { "flag",          required_argument, NULL, 'f'},
+  { "freestanding",  no_argument,       NULL, 'F'},
+  { "debug",         no_argument,       NULL, 'g'},
+  { "jobs",          required_argument, NULL, 'j'},
+  { "kind",          required_argument, NULL, 'k'},
+  { "optimize",      required_argument, NULL, 'O'},
+  { "outline",       optional_argument, NULL, 'U'},
+  { "outfile",       required_argument, NULL, 'o'},
+  { "partial-eval",  optional_argument, NULL, 'p'},
+  { "profile-use",   required_argument, NULL, 'P'},
+  { "progress",      no_argument,       NULL, 'r'},
+  { "stats",         optional_argument, NULL, 'S'},
+  { "symbol",        required_argument, NULL, 's'},
+  { "version",       no_argument,       NULL, 'v'},
+  { NULL,            no_argument,       NULL, 0  }
+};
+
+void version(void) {
+  printf("-[----->+<]>---.--.++.--.+++.----.+++[->++<]>+.++++++++++"
+         "+ +++.+++++.>++++++++++.\n");
+}
+
+void usage(FILE *stream) {
+  fprintf(stream, "Usage: %s [option] [-O level] [-o outfile] [infile...]\n",
+          progname);
+}
+
+void help(void) {
+  usage(stdout);
+  printf("\n");
+  printf("Ahead-of-time brainfuck compiler using libgccjit.\n\n"
+         "Options:\n"
+         "  -c, --cache[=DIR]\t\t Reuse compiled code across runs with -e\n"
+         "  -C, --perf-counters[=FORMAT]\t Print hardware counters of the "
+         "-e run to\n\t\t\t\t stderr as text (default) or json\n"
+         "  -d, --dump\t\t\t Dump assembly\n"
+         "  -D, --outdir DIR\t\t Compile every infile into DIR\n"
+         "  -e, --execute\t\t\t JIT interpret without creating executable\n"
+         "  -f, --flag FLAG\t\t Pass FLAG to libgccjit, e.g. -march=native\n"
+         "  -F, --freestanding\t\t Static executable without libc "
+         "(x86-64)\n"
+         "  -g, --debug\t\t\t Emit debug info mapping code to the "
+         "source\n"
+         "  -h, --help\t\t\t Useless help message\n"
+         "  -j, --jobs N\t\t\t Split into N chunks compiled in parallel,"
+         "\n\t\t\t\t or compile N infiles at a time\n"
+         "  -k, --kind KIND\t\t Output exe (default), obj or lib\n"
+         "  -O, --optimize LEVEL\t\t Optimization level 0-3 or auto "
+         "(default: 3)\n"
+         "  -o, --outfile FILENAME\t Target executable filename\n"
+         "  -p, --partial-eval[=STEPS]\t Precompute up to the first input\n"
+         "  -P, --profile-use FILE\t Optimize with loop counts from "
+         "bf --profile-generate\n"
+         "  -r, --progress\t\t Count loop iterations and report them on "
+         "SIGUSR1\n"
+         "  -S, --stats[=FORMAT]\t\t Print timings and counters to stderr "
+         "as\n\t\t\t\t text (default) or json\n"
+         "  -s, --symbol NAME\t\t Entry point of obj and lib output, see "
+         "bf.h\n"
+         "  -U, --outline[=OPS]\t\t Call repeated loops of at least OPS ops"
+         "\n\t\t\t\t instead of inlining each copy\n"
+         "  -v, --version\t\t\t Print version number\n");
+}
+
+gcc_jit_lvalue *cell_at(codegen *cg, ssize_t offset) {
+  if (cg->cells)
+    return cg->cells[cg->pos + offset - cg->base];
+
+  gcc_jit_rvalue *idx = gcc_jit_lvalue_as_rvalue(cg->index);
+  if (offset != 0)
+    idx = gcc_jit_context_new_binary_op(
+        cg->ctx, cg->loc, GCC_JIT_BINARY_OP_PLUS, cg->int_type, idx,
+        gcc_jit_context_new_rvalue_from_int(cg->ctx, cg->int_type, offset));
+
+  return gcc_jit_context_new_array_access(cg->ctx, cg->loc, cg->tape, idx);
+}
+
+gcc_jit_rvalue *cell_const(codegen *cg, ssize_t x) {
+  return gcc_jit_context_new_rvalue_from_int(cg->ctx, cg->cell_type,
+                                             (uint8_t) x);
+}
+
+gcc_jit_rvalue *cell_cmp(codegen *cg, enum gcc_jit_comparison cmp) {
+  return gcc_jit_context_new_comparison(
+      cg->ctx, cg->loc, cmp, gcc_jit_lvalue_as_rvalue(cell_at(cg, 0)),
+      gcc_jit_context_zero(cg->ctx, cg->cell_type));
+}
+
+void move(codegen *cg, gcc_jit_block *block, ssize_t offset) {
+  if (cg->cells)
+    cg->pos += offset;
+  else if (offset != 0)
+    gcc_jit_block_add_assignment_op(
+        block, cg->loc, cg->index, GCC_JIT_BINARY_OP_PLUS,
+        gcc_jit_context_new_rvalue_from_int(cg->ctx, cg->int_type, offset));
+}
+
+gcc_jit_lvalue *buffer_field(gcc_jit_lvalue *buf, gcc_jit_field *field) {
+  return gcc_jit_lvalue_access_field(buf, NULL, field);
+}
+
+gcc_jit_lvalue *buffer_data(gcc_jit_context *ctx, runtime *rt,
+                            gcc_jit_lvalue *buf, gcc_jit_rvalue *i) {
+  return gcc_jit_context_new_array_access(
+      ctx, NULL, gcc_jit_lvalue_as_rvalue(buffer_field(buf, rt->data)), i);
+}
+
+/*
+ * Declares the buffers and slow paths of rt.h. With -e the generated code
+ * shares them with the aot process itself, executables get their own
+ * copy from define_runtime(), exported when it is split into chunks.
+ */
+runtime *declare_runtime(gcc_jit_context *ctx,
+                         enum gcc_jit_global_kind global_kind) {
+  gcc_jit_type *void_type = gcc_jit_context_get_type(ctx, GCC_JIT_TYPE_VOID);
+  gcc_jit_type *int_type = gcc_jit_context_get_type(ctx, GCC_JIT_TYPE_INT);
+  gcc_jit_type *size_type = gcc_jit_context_get_type(ctx, GCC_JIT_TYPE_SIZE_T);
+  gcc_jit_type *cell_type = gcc_jit_context_get_type(ctx, GCC_JIT_TYPE_UINT8_T);
+
+  runtime *rt;
+  if (!(rt = malloc(sizeof(runtime))))
+    err(EXIT_FAILURE, NULL);
+
+  rt->pos = gcc_jit_context_new_field(ctx, NULL, size_type, "pos");
+  rt->len = gcc_jit_context_new_field(ctx, NULL, size_type, "len");
+  rt->total = gcc_jit_context_new_field(ctx, NULL, size_type, "total");
+  rt->data = gcc_jit_context_new_field(
+      ctx, NULL,
+      gcc_jit_context_new_array_type(ctx, NULL, cell_type, RT_BUF_SIZE),
+      "data");
+
+  gcc_jit_field *fields[4] = { rt->pos, rt->len, rt->total, rt->data };
+  gcc_jit_type *buffer_type = gcc_jit_struct_as_type(
+      gcc_jit_context_new_struct_type(ctx, NULL, "rt_buffer", 4, fields));
+
+  rt->in = gcc_jit_context_new_global(ctx, NULL, global_kind, buffer_type,
+                                      "rt_in");
+  rt->out = gcc_jit_context_new_global(ctx, NULL, global_kind, buffer_type,
+                                       "rt_out");
+
+  enum gcc_jit_function_kind fn_kind = GCC_JIT_FUNCTION_INTERNAL;
+  if (global_kind == GCC_JIT_GLOBAL_IMPORTED)
+    fn_kind = GCC_JIT_FUNCTION_IMPORTED;
+  else if (global_kind == GCC_JIT_GLOBAL_EXPORTED)
+    fn_kind = GCC_JIT_FUNCTION_EXPORTED;
+  rt->flush = gcc_jit_context_new_function(ctx, NULL, fn_kind, void_type,
+                                           "rt_flush", 0, NULL, 0);
+  rt->fill = gcc_jit_context_new_function(ctx, NULL, fn_kind, int_type,
+                                          "rt_fill", 0, NULL, 0);
+  rt->write = NULL;
+  rt->progress = rt->backedges = NULL;
+  rt->report = rt->watch = NULL;
+
+  return rt;
+}
+
+/*
+ * Declares the progress counters and rt_report() of rt.h, shared with
+ * the aot process with -e and generated by define_progress() otherwise.
+ */
+void declare_progress(gcc_jit_context *ctx, runtime *rt,
+                      enum gcc_jit_global_kind global_kind) {
+  gcc_jit_type *void_type = gcc_jit_context_get_type(ctx, GCC_JIT_TYPE_VOID);
+  gcc_jit_type *int_type = gcc_jit_context_get_type(ctx, GCC_JIT_TYPE_INT);
+  gcc_jit_type *long_type = gcc_jit_context_get_type(ctx, GCC_JIT_TYPE_LONG);
+  gcc_jit_type *size_type = gcc_jit_context_get_type(ctx, GCC_JIT_TYPE_SIZE_T);
+  gcc_jit_type *count_type =
+      gcc_jit_context_get_type(ctx, GCC_JIT_TYPE_UINT64_T);
+
+  rt->progress = gcc_jit_context_new_global(
+      ctx, NULL, global_kind, gcc_jit_type_get_volatile(int_type),
+      "rt_progress");
+  rt->backedges = gcc_jit_context_new_global(ctx, NULL, global_kind,
+                                             count_type, "rt_backedges");
+
+  gcc_jit_param *params[2] = {
+    gcc_jit_context_new_param(ctx, NULL, size_type, "pos"),
+    gcc_jit_context_new_param(ctx, NULL, long_type, "index"),
+  };
+  rt->report = gcc_jit_context_new_function(
+      ctx, NULL,
+      global_kind == GCC_JIT_GLOBAL_IMPORTED ? GCC_JIT_FUNCTION_IMPORTED
+                                             : GCC_JIT_FUNCTION_INTERNAL,
+      void_type, "rt_report", 2, params, 0);
+}
+
+/*
+ * Wraps read(2) or write(2) from libc, or for freestanding executables
+ * defines it as a raw system call with the same signature. Either way
+ * errors are returned as -errno, like the system call does.
+ */
+gcc_jit_function *declare_syscall(gcc_jit_context *ctx, const char *name,
+                                  long nr, bool freestanding) {
+  gcc_jit_type *int_type = gcc_jit_context_get_type(ctx, GCC_JIT_TYPE_INT);
+  gcc_jit_type *long_type = gcc_jit_context_get_type(ctx, GCC_JIT_TYPE_LONG);
+  gcc_jit_type *size_type = gcc_jit_context_get_type(ctx, GCC_JIT_TYPE_SIZE_T);
+  gcc_jit_type *void_ptr = gcc_jit_context_get_type(ctx, GCC_JIT_TYPE_VOID_PTR);
+
+  gcc_jit_param *params[3] = {
+    gcc_jit_context_new_param(ctx, NULL, int_type, "fd"),
+    gcc_jit_context_new_param(ctx, NULL, void_ptr, "buf"),
+    gcc_jit_context_new_param(ctx, NULL, size_type, "count"),
+  };
+
+  char wrapper[32];
+  snprintf(wrapper, sizeof(wrapper), "sys_%s", name);
+  gcc_jit_function *fn = gcc_jit_context_new_function(
+      ctx, NULL, GCC_JIT_FUNCTION_INTERNAL, long_type, wrapper, 3, params, 0);
+  gcc_jit_lvalue *ret = gcc_jit_function_new_local(fn, NULL, long_type, "ret");
+  gcc_jit_block *block = gcc_jit_function_new_block(fn, "entry");
+
+  if (!freestanding) {
+    gcc_jit_param *libc_params[3] = {
+      gcc_jit_context_new_param(ctx, NULL, int_type, "fd"),
+      gcc_jit_context_new_param(ctx, NULL, void_ptr, "buf"),
+      gcc_jit_context_new_param(ctx, NULL, size_type, "count"),
+    };
+    gcc_jit_function *libc_fn =
+        gcc_jit_context_new_function(ctx, NULL, GCC_JIT_FUNCTION_IMPORTED,
+                                     long_type, name, 3, libc_params, 0);
+    // glibc and musl both expose errno through __errno_location()
+    gcc_jit_function *errno_location = gcc_jit_context_new_function(
+        ctx, NULL, GCC_JIT_FUNCTION_IMPORTED,
+        gcc_jit_type_get_pointer(int_type), "__errno_location", 0, NULL, 0);
+
+    gcc_jit_rvalue *args[3];
+    for (int i = 0; i < 3; i++)
+      args[i] = gcc_jit_param_as_rvalue(params[i]);
+    gcc_jit_block_add_assignment(
+        block, NULL, ret,
+        gcc_jit_context_new_call(ctx, NULL, libc_fn, 3, args));
+
+    gcc_jit_block *error = gcc_jit_function_new_block(fn, "error");
+    gcc_jit_block *done = gcc_jit_function_new_block(fn, "done");
+    gcc_jit_block_end_with_conditional(
+        block, NULL,
+        gcc_jit_context_new_comparison(ctx, NULL, GCC_JIT_COMPARISON_LT,
+                                       gcc_jit_lvalue_as_rvalue(ret),
+                                       gcc_jit_context_zero(ctx, long_type)),
+        error, done);
+
+    gcc_jit_rvalue *code = gcc_jit_lvalue_as_rvalue(gcc_jit_rvalue_dereference(
+        gcc_jit_context_new_call(ctx, NULL, errno_location, 0, NULL), NULL));
+    gcc_jit_block_add_assignment(
+        error, NULL, ret,
+        gcc_jit_context_new_unary_op(
+            ctx, NULL, GCC_JIT_UNARY_OP_MINUS, long_type,
+            gcc_jit_context_new_cast(ctx, NULL, code, long_type)));
+    gcc_jit_block_end_with_jump(error, NULL, done);
+    gcc_jit_block_end_with_return(done, NULL, gcc_jit_lvalue_as_rvalue(ret));
+
+    return fn;
+  }
+
+  gcc_jit_extended_asm *ext =
+      gcc_jit_block_add_extended_asm(block, NULL, "syscall");
+  gcc_jit_extended_asm_set_volatile_flag(ext, 1);
+  gcc_jit_extended_asm_add_output_operand(ext, NULL, "=a", ret);
+  gcc_jit_extended_asm_add_input_operand(
+      ext, NULL, "a", gcc_jit_context_new_rvalue_from_long(ctx, long_type, nr));
+
+  const char *regs[3] = { "D", "S", "d" };
+  for (int i = 0; i < 3; i++)
+    gcc_jit_extended_asm_add_input_operand(
+        ext, NULL, regs[i],
+        gcc_jit_context_new_cast(ctx, NULL, gcc_jit_param_as_rvalue(params[i]),
+                                 long_type));
+
+  gcc_jit_extended_asm_add_clobber(ext, "rcx");
+  gcc_jit_extended_asm_add_clobber(ext, "r11");
+  gcc_jit_extended_asm_add_clobber(ext, "memory");
+  gcc_jit_block_end_with_return(block, NULL, gcc_jit_lvalue_as_rvalue(ret));
+
+  return fn;
+}
+
+/*
+ * Imports _exit(2), or for freestanding executables defines it on top of
+ * the raw exit_group system call.
+ */
+gcc_jit_function *declare_exit(gcc_jit_context *ctx, bool freestanding) {
+  gcc_jit_type *void_type = gcc_jit_context_get_type(ctx, GCC_JIT_TYPE_VOID);
+  gcc_jit_type *int_type = gcc_jit_context_get_type(ctx, GCC_JIT_TYPE_INT);
+  gcc_jit_type *size_type = gcc_jit_context_get_type(ctx, GCC_JIT_TYPE_SIZE_T);
+  gcc_jit_type *void_ptr = gcc_jit_context_get_type(ctx, GCC_JIT_TYPE_VOID_PTR);
+
+  gcc_jit_param *param =
+      gcc_jit_context_new_param(ctx, NULL, int_type, "status");
+  if (!freestanding)
+    return gcc_jit_context_new_function(
+        ctx, NULL, GCC_JIT_FUNCTION_IMPORTED, void_type, "_exit", 1, &param,
+        0);
+
+  gcc_jit_function *sys_exit_group =
+      declare_syscall(ctx, "exit_group", SYS_exit_group, true);
+  gcc_jit_function *fn =
+      gcc_jit_context_new_function(ctx, NULL, GCC_JIT_FUNCTION_INTERNAL,
+                                   void_type, "sys_exit", 1, &param, 0);
+  gcc_jit_block *block = gcc_jit_function_new_block(fn, "entry");
+
+  gcc_jit_rvalue *args[3] = {
+    gcc_jit_param_as_rvalue(param),
+    gcc_jit_context_null(ctx, void_ptr),
+    gcc_jit_context_zero(ctx, size_type),
+  };
+  gcc_jit_block_add_eval(
+      block, NULL,
+      gcc_jit_context_new_call(ctx, NULL, sys_exit_group, 3, args));
+  gcc_jit_block_end_with_void_return(block, NULL);
+
+  return fn;
+}
+
+/*
+ * Entry point of freestanding executables. There is no libc to set up,
+ * so align the stack, call main and pass its result to exit(2).
+ */
+void define_start(gcc_jit_context *ctx) {
+  char start[256];
+  snprintf(start, sizeof(start),
+           "\t.text\n"
+           "\t.globl _start\n"
+           "_start:\n"
+           "\txor %%ebp, %%ebp\n"
+           "\tand $-16, %%rsp\n"
+           "\tcall main\n"
+           "\tmov %%eax, %%edi\n"
+           "\tmov $%d, %%eax\n"
+           "\tsyscall\n",
+           SYS_exit);
+
+  gcc_jit_context_add_top_level_asm(ctx, NULL, start);
+}
+
+void add_freestanding_options(gcc_jit_context *ctx) {
+  gcc_jit_context_add_command_line_option(ctx, "-ffreestanding");
+  gcc_jit_context_add_command_line_option(ctx, "-fno-stack-protector");
+  gcc_jit_context_add_command_line_option(ctx,
+                                          "-fno-tree-loop-distribute-patterns");
+  gcc_jit_context_add_driver_option(ctx, "-nostdlib");
+  gcc_jit_context_add_driver_option(ctx, "-static");
+}
+
+/*
+ * Generated equivalents of rt_flush() and rt_fill() from rt.c, plus
+ * rt_write() for output that bypasses the buffer.
+ */
+void define_runtime(gcc_jit_context *ctx, runtime *rt, bool freestanding) {
+  gcc_jit_type *void_type = gcc_jit_context_get_type(ctx, GCC_JIT_TYPE_VOID);
+  gcc_jit_type *int_type = gcc_jit_context_get_type(ctx, GCC_JIT_TYPE_INT);
+  gcc_jit_type *cell_type = gcc_jit_context_get_type(ctx, GCC_JIT_TYPE_UINT8_T);
+  gcc_jit_type *long_type = gcc_jit_context_get_type(ctx, GCC_JIT_TYPE_LONG);
+  gcc_jit_type *size_type = gcc_jit_context_get_type(ctx, GCC_JIT_TYPE_SIZE_T);
+
+  gcc_jit_function *sys_write =
+      declare_syscall(ctx, "write", SYS_write, freestanding);
+  gcc_jit_function *sys_read =
+      declare_syscall(ctx, "read", SYS_read, freestanding);
+  gcc_jit_function *sys_exit = declare_exit(ctx, freestanding);
+
+  gcc_jit_param *params[2] = {
+    gcc_jit_context_new_param(ctx, NULL, gcc_jit_type_get_pointer(cell_type),
+                              "buf"),
+    gcc_jit_context_new_param(ctx, NULL, size_type, "count"),
+  };
+  gcc_jit_function *fn = rt->write = gcc_jit_context_new_function(
+      ctx, NULL, GCC_JIT_FUNCTION_INTERNAL, void_type, "rt_write", 2, params,
+      0);
+  gcc_jit_rvalue *buf = gcc_jit_param_as_rvalue(params[0]);
+  gcc_jit_rvalue *count = gcc_jit_param_as_rvalue(params[1]);
+
+  gcc_jit_lvalue *i = gcc_jit_function_new_local(fn, NULL, size_type, "i");
+  gcc_jit_lvalue *n = gcc_jit_function_new_local(fn, NULL, long_type, "n");
+  gcc_jit_block *entry = gcc_jit_function_new_block(fn, "entry");
+  gcc_jit_block *loop = gcc_jit_function_new_block(fn, "loop");
+  gcc_jit_block *body = gcc_jit_function_new_block(fn, "write");
+  gcc_jit_block *next = gcc_jit_function_new_block(fn, "next");
+  gcc_jit_block *retry = gcc_jit_function_new_block(fn, "retry");
+  gcc_jit_block *fail = gcc_jit_function_new_block(fn, "fail");
+  gcc_jit_block *done = gcc_jit_function_new_block(fn, "done");
+
+  gcc_jit_block_add_assignment(entry, NULL, i,
+                               gcc_jit_context_zero(ctx, size_type));
+  gcc_jit_block_end_with_jump(entry, NULL, loop);
+
+  gcc_jit_block_end_with_conditional(
+      loop, NULL,
+      gcc_jit_context_new_comparison(ctx, NULL, GCC_JIT_COMPARISON_LT,
+                                     gcc_jit_lvalue_as_rvalue(i), count),
+      body, done);
+
+  gcc_jit_rvalue *args[3] = {
+    gcc_jit_context_new_rvalue_from_int(ctx, int_type, STDOUT_FILENO),
+    gcc_jit_lvalue_get_address(
+        gcc_jit_context_new_array_access(ctx, NULL, buf,
+                                         gcc_jit_lvalue_as_rvalue(i)),
+        NULL),
+    gcc_jit_context_new_binary_op(ctx, NULL, GCC_JIT_BINARY_OP_MINUS,
+                                  size_type, count,
+                                  gcc_jit_lvalue_as_rvalue(i)),
+  };
+  gcc_jit_block_add_assignment(
+      body, NULL, n, gcc_jit_context_new_call(ctx, NULL, sys_write, 3, args));
+  gcc_jit_block_end_with_conditional(
+      body, NULL,
+      gcc_jit_context_new_comparison(ctx, NULL, GCC_JIT_COMPARISON_GT,
+                                     gcc_jit_lvalue_as_rvalue(n),
+                                     gcc_jit_context_zero(ctx, long_type)),
+      next, retry);
+
+  // Like rt_flush(), retry on EINTR and fail on any other error or on a
+  // write that makes no progress
+  gcc_jit_block_end_with_conditional(
+      retry, NULL,
+      gcc_jit_context_new_comparison(
+          ctx, NULL, GCC_JIT_COMPARISON_EQ, gcc_jit_lvalue_as_rvalue(n),
+          gcc_jit_context_new_rvalue_from_long(ctx, long_type, -EINTR)),
+      loop, fail);
+
+  static const char message[] = "write: output error\n";
+  gcc_jit_rvalue *fail_args[3] = {
+    gcc_jit_context_new_rvalue_from_int(ctx, int_type, STDERR_FILENO),
+    gcc_jit_context_new_cast(
+        ctx, NULL, gcc_jit_context_new_string_literal(ctx, message),
+        gcc_jit_type_get_pointer(cell_type)),
+    gcc_jit_context_new_rvalue_from_int(ctx, size_type, sizeof(message) - 1),
+  };
+  gcc_jit_block_add_eval(
+      fail, NULL, gcc_jit_context_new_call(ctx, NULL, sys_write, 3, fail_args));
+  gcc_jit_rvalue *status =
+      gcc_jit_context_new_rvalue_from_int(ctx, int_type, EXIT_FAILURE);
+  gcc_jit_block_add_eval(fail, NULL,
+                         gcc_jit_context_new_call(ctx, NULL, sys_exit, 1,
+                                                  &status));
+  gcc_jit_block_end_with_jump(fail, NULL, done);
+
+  gcc_jit_block_add_assignment_op(
+      next, NULL, i, GCC_JIT_BINARY_OP_PLUS,
+      gcc_jit_context_new_cast(ctx, NULL, gcc_jit_lvalue_as_rvalue(n),
+                               size_type));
+  gcc_jit_block_end_with_jump(next, NULL, loop);
+  gcc_jit_block_end_with_void_return(done, NULL);
+
+  fn = rt->flush;
+  entry = gcc_jit_function_new_block(fn, "entry");
+
+  args[0] = gcc_jit_lvalue_get_address(
+      buffer_data(ctx, rt, rt->out, gcc_jit_context_zero(ctx, size_type)),
+      NULL);
+  args[1] = gcc_jit_lvalue_as_rvalue(buffer_field(rt->out, rt->len));
+  gcc_jit_block_add_eval(entry, NULL,
+                         gcc_jit_context_new_call(ctx, NULL, rt->write, 2,
+                                                  args));
+
+  gcc_jit_block_add_assignment_op(
+      entry, NULL, buffer_field(rt->out, rt->total), GCC_JIT_BINARY_OP_PLUS,
+      gcc_jit_lvalue_as_rvalue(buffer_field(rt->out, rt->len)));
+  gcc_jit_block_add_assignment(entry, NULL, buffer_field(rt->out, rt->len),
+                               gcc_jit_context_zero(ctx, size_type));
+  gcc_jit_block_end_with_void_return(entry, NULL);
+
+  fn = rt->fill;
+  n = gcc_jit_function_new_local(fn, NULL, long_type, "n");
+  entry = gcc_jit_function_new_block(fn, "entry");
+  gcc_jit_block *eof = gcc_jit_function_new_block(fn, "eof");
+  gcc_jit_block *filled = gcc_jit_function_new_block(fn, "filled");
+
+  gcc_jit_block_add_eval(entry, NULL,
+                         gcc_jit_context_new_call(ctx, NULL, rt->flush, 0,
+                                                  NULL));
+
+  args[0] = gcc_jit_context_new_rvalue_from_int(ctx, int_type, STDIN_FILENO);
+  args[1] = gcc_jit_lvalue_get_address(
+      buffer_data(ctx, rt, rt->in, gcc_jit_context_zero(ctx, size_type)),
+      NULL);
+  args[2] = gcc_jit_context_new_rvalue_from_int(ctx, size_type, RT_BUF_SIZE);
+  gcc_jit_block_add_assignment(
+      entry, NULL, n, gcc_jit_context_new_call(ctx, NULL, sys_read, 3, args));
+  gcc_jit_block_end_with_conditional(
+      entry, NULL,
+      gcc_jit_context_new_comparison(ctx, NULL, GCC_JIT_COMPARISON_LE,
+                                     gcc_jit_lvalue_as_rvalue(n),
+                                     gcc_jit_context_zero(ctx, long_type)),
+      eof, filled);
+
+  gcc_jit_block_end_with_return(
+      eof, NULL, gcc_jit_context_new_rvalue_from_int(ctx, int_type, EOF));
+
+  gcc_jit_rvalue *len =
+      gcc_jit_context_new_cast(ctx, NULL, gcc_jit_lvalue_as_rvalue(n),
+                               size_type);
+  gcc_jit_block_add_assignment(filled, NULL, buffer_field(rt->in, rt->len),
+                               len);
+  gcc_jit_block_add_assignment_op(filled, NULL,
+                                  buffer_field(rt->in, rt->total),
+                                  GCC_JIT_BINARY_OP_PLUS, len);
+  gcc_jit_block_add_assignment(filled, NULL, buffer_field(rt->in, rt->pos),
+                               gcc_jit_context_one(ctx, size_type));
+  gcc_jit_block_end_with_return(
+      filled, NULL,
+      gcc_jit_context_new_cast(
+          ctx, NULL,
+          gcc_jit_lvalue_as_rvalue(buffer_data(
+              ctx, rt, rt->in, gcc_jit_context_zero(ctx, size_type))),
+          int_type));
+}
+
+/*
+ * Generated equivalents of rt_watch_progress() and rt_report() from
+ * rt.c, on top of signal(3) and dprintf(3).
+ */
+void define_progress(gcc_jit_context *ctx, runtime *rt) {
+  gcc_jit_type *void_type = gcc_jit_context_get_type(ctx, GCC_JIT_TYPE_VOID);
+  gcc_jit_type *int_type = gcc_jit_context_get_type(ctx, GCC_JIT_TYPE_INT);
+  gcc_jit_type *size_type = gcc_jit_context_get_type(ctx, GCC_JIT_TYPE_SIZE_T);
+  gcc_jit_type *string_type =
+      gcc_jit_context_get_type(ctx, GCC_JIT_TYPE_CONST_CHAR_PTR);
+  gcc_jit_type *handler_type = gcc_jit_context_new_function_ptr_type(
+      ctx, NULL, void_type, 1, &int_type, 0);
+
+  gcc_jit_param *param = gcc_jit_context_new_param(ctx, NULL, int_type, "sig");
+  gcc_jit_function *request = gcc_jit_context_new_function(
+      ctx, NULL, GCC_JIT_FUNCTION_INTERNAL, void_type, "request_progress", 1,
+      &param, 0);
+  gcc_jit_block *block = gcc_jit_function_new_block(request, "entry");
+  gcc_jit_block_add_assignment(block, NULL, rt->progress,
+                               gcc_jit_context_one(ctx, int_type));
+  gcc_jit_block_end_with_void_return(block, NULL);
+
+  gcc_jit_param *params[2] = {
+    gcc_jit_context_new_param(ctx, NULL, int_type, "sig"),
+    gcc_jit_context_new_param(ctx, NULL, handler_type, "handler"),
+  };
+  gcc_jit_function *sys_signal =
+      gcc_jit_context_new_function(ctx, NULL, GCC_JIT_FUNCTION_IMPORTED,
+                                   handler_type, "signal", 2, params, 0);
+
+  rt->watch =
+      gcc_jit_context_new_function(ctx, NULL, GCC_JIT_FUNCTION_INTERNAL,
+                                   void_type, "rt_watch_progress", 0, NULL, 0);
+  block = gcc_jit_function_new_block(rt->watch, "entry");
+
+  gcc_jit_rvalue *args[8] = {
+    gcc_jit_context_new_rvalue_from_int(ctx, int_type, SIGUSR1),
+    gcc_jit_function_get_address(request, NULL),
+  };
+  gcc_jit_block_add_eval(block, NULL,
+                         gcc_jit_context_new_call(ctx, NULL, sys_signal, 2,
+                                                  args));
+  gcc_jit_block_end_with_void_return(block, NULL);
+
+  params[0] = gcc_jit_context_new_param(ctx, NULL, int_type, "fd");
+  params[1] = gcc_jit_context_new_param(ctx, NULL, string_type, "format");
+  gcc_jit_function *sys_dprintf =
+      gcc_jit_context_new_function(ctx, NULL, GCC_JIT_FUNCTION_IMPORTED,
+                                   int_type, "dprintf", 2, params, 1);
+  gcc_jit_lvalue *name = gcc_jit_context_new_global(
+      ctx, NULL, GCC_JIT_GLOBAL_IMPORTED, string_type,
+      "program_invocation_short_name");
+
+  block = gcc_jit_function_new_block(rt->report, "entry");
+  gcc_jit_block_add_assignment(block, NULL, rt->progress,
+                               gcc_jit_context_zero(ctx, int_type));
+
+  // Byte counts are as seen by the program, buffered or not
+  gcc_jit_rvalue *unread = gcc_jit_context_new_binary_op(
+      ctx, NULL, GCC_JIT_BINARY_OP_MINUS, size_type,
+      gcc_jit_lvalue_as_rvalue(buffer_field(rt->in, rt->len)),
+      gcc_jit_lvalue_as_rvalue(buffer_field(rt->in, rt->pos)));
+
+  args[0] = gcc_jit_context_new_rvalue_from_int(ctx, int_type, STDERR_FILENO);
+  args[1] = gcc_jit_context_new_string_literal(
+      ctx, "%s: at source offset %zu, cell %ld, %" PRIu64 " back edges, "
+           "%zu bytes read, %zu bytes written\n");
+  args[2] = gcc_jit_lvalue_as_rvalue(name);
+  args[3] = gcc_jit_param_as_rvalue(gcc_jit_function_get_param(rt->report, 0));
+  args[4] = gcc_jit_param_as_rvalue(gcc_jit_function_get_param(rt->report, 1));
+  args[5] = gcc_jit_lvalue_as_rvalue(rt->backedges);
+  args[6] = gcc_jit_context_new_binary_op(
+      ctx, NULL, GCC_JIT_BINARY_OP_MINUS, size_type,
+      gcc_jit_lvalue_as_rvalue(buffer_field(rt->in, rt->total)), unread);
+  args[7] = gcc_jit_context_new_binary_op(
+      ctx, NULL, GCC_JIT_BINARY_OP_PLUS, size_type,
+      gcc_jit_lvalue_as_rvalue(buffer_field(rt->out, rt->total)),
+      gcc_jit_lvalue_as_rvalue(buffer_field(rt->out, rt->len)));
+  gcc_jit_block_add_eval(block, NULL,
+                         gcc_jit_context_new_call(ctx, NULL, sys_dprintf, 8,
+                                                  args));
+  gcc_jit_block_end_with_void_return(block, NULL);
+}
+
+// Inline copy of rt_put()
+gcc_jit_block *emit_put(codegen *cg, gcc_jit_block *block) {
+  runtime *rt = cg->rt;
+  gcc_jit_type *size_type =
+      gcc_jit_context_get_type(cg->ctx, GCC_JIT_TYPE_SIZE_T);
+
+  if (!rt) {
+    gcc_jit_rvalue *args[2] = {
+      gcc_jit_context_new_cast(cg->ctx, cg->loc,
+                               gcc_jit_lvalue_as_rvalue(cell_at(cg, 0)),
+                               cg->int_type),
+      cg->io,
+    };
+    gcc_jit_block_add_eval(block, cg->loc,
+                           gcc_jit_context_new_call_through_ptr(
+                               cg->ctx, cg->loc, cg->put, 2, args));
+    return block;
+  }
+
+  gcc_jit_block *flush = gcc_jit_function_new_block(cg->fn, "flush");
+  gcc_jit_block *after = gcc_jit_function_new_block(cg->fn, "put_end");
+
+  gcc_jit_block_add_assignment(
+      block, cg->loc,
+      buffer_data(cg->ctx, rt, rt->out,
+                  gcc_jit_lvalue_as_rvalue(buffer_field(rt->out, rt->len))),
+      gcc_jit_lvalue_as_rvalue(cell_at(cg, 0)));
+  gcc_jit_block_add_assignment_op(block, cg->loc,
+                                  buffer_field(rt->out, rt->len),
+                                  GCC_JIT_BINARY_OP_PLUS,
+                                  gcc_jit_context_one(cg->ctx, size_type));
+  gcc_jit_block_end_with_conditional(
+      block, cg->loc,
+      gcc_jit_context_new_comparison(
+          cg->ctx, cg->loc, GCC_JIT_COMPARISON_EQ,
+          gcc_jit_lvalue_as_rvalue(buffer_field(rt->out, rt->len)),
+          gcc_jit_context_new_rvalue_from_int(cg->ctx, size_type,
+                                              RT_BUF_SIZE)),
+      flush, after);
+
+  gcc_jit_block_add_eval(flush, cg->loc,
+                         gcc_jit_context_new_call(cg->ctx, cg->loc, rt->flush,
+                                                  0, NULL));
+  gcc_jit_block_end_with_jump(flush, cg->loc, after);
+
+  return after;
+}
+
+// Inline copy of rt_get()
+gcc_jit_block *emit_get(codegen *cg, gcc_jit_block *block) {
+  runtime *rt = cg->rt;
+  gcc_jit_type *size_type =
+      gcc_jit_context_get_type(cg->ctx, GCC_JIT_TYPE_SIZE_T);
+
+  if (!rt) {
+    gcc_jit_block_add_assignment(
+        block, cg->loc, cell_at(cg, 0),
+        gcc_jit_context_new_cast(cg->ctx, cg->loc,
+                                 gcc_jit_context_new_call_through_ptr(
+                                     cg->ctx, cg->loc, cg->get, 1, &cg->io),
+                                 cg->cell_type));
+    return block;
+  }
+
+  gcc_jit_block *buffered = gcc_jit_function_new_block(cg->fn, "get");
+  gcc_jit_block *fill = gcc_jit_function_new_block(cg->fn, "fill");
+  gcc_jit_block *after = gcc_jit_function_new_block(cg->fn, "get_end");
+
+  gcc_jit_block_end_with_conditional(
+      block, cg->loc,
+      gcc_jit_context_new_comparison(
+          cg->ctx, cg->loc, GCC_JIT_COMPARISON_LT,
+          gcc_jit_lvalue_as_rvalue(buffer_field(rt->in, rt->pos)),
+          gcc_jit_lvalue_as_rvalue(buffer_field(rt->in, rt->len))),
+      buffered, fill);
+
+  gcc_jit_block_add_assignment(
+      buffered, cg->loc, cell_at(cg, 0),
+      gcc_jit_lvalue_as_rvalue(buffer_data(
+          cg->ctx, rt, rt->in,
+          gcc_jit_lvalue_as_rvalue(buffer_field(rt->in, rt->pos)))));
+  gcc_jit_block_add_assignment_op(buffered, cg->loc,
+                                  buffer_field(rt->in, rt->pos),
+                                  GCC_JIT_BINARY_OP_PLUS,
+                                  gcc_jit_context_one(cg->ctx, size_type));
+  gcc_jit_block_end_with_jump(buffered, cg->loc, after);
+
+  gcc_jit_block_add_assignment(
+      fill, cg->loc, cell_at(cg, 0),
+      gcc_jit_context_new_cast(
+          cg->ctx, cg->loc,
+          gcc_jit_context_new_call(cg->ctx, cg->loc, rt->fill, 0, NULL),
+          cg->cell_type));
+  gcc_jit_block_end_with_jump(fill, cg->loc, after);
+
+  return after;
+}
+
+// Counts a taken back edge and calls rt_report() once SIGUSR1 arrived
+gcc_jit_block *emit_progress(codegen *cg, gcc_jit_block *block, size_t pos) {
+  runtime *rt = cg->rt;
+  gcc_jit_type *long_type =
+      gcc_jit_context_get_type(cg->ctx, GCC_JIT_TYPE_LONG);
+  gcc_jit_type *size_type =
+      gcc_jit_context_get_type(cg->ctx, GCC_JIT_TYPE_SIZE_T);
+  gcc_jit_type *count_type =
+      gcc_jit_context_get_type(cg->ctx, GCC_JIT_TYPE_UINT64_T);
+
+  gcc_jit_block *report = gcc_jit_function_new_block(cg->fn, "report");
+  gcc_jit_block *after = gcc_jit_function_new_block(cg->fn, "report_end");
+
+  gcc_jit_block_add_assignment_op(block, cg->loc, rt->backedges,
+                                  GCC_JIT_BINARY_OP_PLUS,
+                                  gcc_jit_context_one(cg->ctx, count_type));
+  gcc_jit_block_end_with_conditional(
+      block, cg->loc,
+      gcc_jit_context_new_comparison(
+          cg->ctx, cg->loc, GCC_JIT_COMPARISON_NE,
+          gcc_jit_lvalue_as_rvalue(rt->progress),
+          gcc_jit_context_zero(cg->ctx, cg->int_type)),
+      report, after);
+
+  // Promoted cells have no index, their position is static
+  gcc_jit_rvalue *index =
+      cg->cells
+          ? gcc_jit_context_new_rvalue_from_long(cg->ctx, long_type, cg->pos)
+          : gcc_jit_context_new_cast(cg->ctx, cg->loc,
+                                     gcc_jit_lvalue_as_rvalue(cg->index),
+                                     long_type);
+  gcc_jit_rvalue *args[2] = {
+    gcc_jit_context_new_rvalue_from_long(cg->ctx, size_type, pos),
+    index,
+  };
+  gcc_jit_block_add_eval(report, cg->loc,
+                         gcc_jit_context_new_call(cg->ctx, cg->loc, rt->report,
+                                                  2, args));
+  gcc_jit_block_end_with_jump(report, cg->loc, after);
+
+  return after;
+}
+
+/*
+ * Wraps a branch condition in __builtin_expect when the profile shows it
+ * going one way at least LIKELY_RATIO of the time, which is what GCC
+ * uses to order blocks and move cold paths out of line.
+ */
+gcc_jit_rvalue *expect(codegen *cg, gcc_jit_rvalue *cond, uint64_t taken,
+                       uint64_t total) {
+  if (!cg->expect || total == 0)
+    return cond;
+
+  double ratio = (double) taken / total;
+  if (ratio < LIKELY_RATIO && ratio > 1 - LIKELY_RATIO)
+    return cond;
+
+  gcc_jit_type *long_type =
+      gcc_jit_context_get_type(cg->ctx, GCC_JIT_TYPE_LONG);
+  gcc_jit_rvalue *args[2] = {
+    gcc_jit_context_new_cast(cg->ctx, cg->loc, cond, long_type),
+    gcc_jit_context_new_rvalue_from_long(cg->ctx, long_type, ratio > 0.5),
+  };
+
+  return gcc_jit_context_new_comparison(
+      cg->ctx, cg->loc, GCC_JIT_COMPARISON_NE,
+      gcc_jit_context_new_call(cg->ctx, cg->loc, cg->expect, 2, args),
+      gcc_jit_context_zero(cg->ctx, long_type));
+}
+
+/*
+ * Small loops that run many iterations per entry get their body emitted
+ * twice per back edge test, since libgccjit has no per-loop unrolling
+ * knobs.
+ */
+int unroll_factor(loop_profile *l, size_t body_ops) {
+  if (!l || body_ops > UNROLL_MAX_OPS || l->backedges < UNROLL_MIN_BACKEDGES)
+    return 1;
+
+  uint64_t runs = l->entries - l->skips;
+  if (!runs)
+    return 1;
+
+  return ((runs + l->backedges) / runs >= UNROLL_MIN_TRIPS) ? 2 : 1;
+}
+
+void locate(codegen *cg, size_t k) {
+  if (cg->locs)
+    cg->loc = cg->locs[k];
+}
+
+// Chunks and outlined loops take and return the tape index
+gcc_jit_function *declare_kernel(gcc_jit_context *ctx, const char *name,
+                                 enum gcc_jit_function_kind kind) {
+  gcc_jit_type *int_type = gcc_jit_context_get_type(ctx, GCC_JIT_TYPE_INT);
+  gcc_jit_type *cell_type = gcc_jit_context_get_type(ctx, GCC_JIT_TYPE_UINT8_T);
+
+  gcc_jit_param *params[2] = {
+    gcc_jit_context_new_param(ctx, NULL, gcc_jit_type_get_pointer(cell_type),
+                              "tape"),
+    gcc_jit_context_new_param(ctx, NULL, int_type, "index"),
+  };
+
+  return gcc_jit_context_new_function(ctx, NULL, kind, int_type, name, 2,
+                                      params, 0);
+}
+
+gcc_jit_function *declare_chunk(gcc_jit_context *ctx, size_t i,
+                                enum gcc_jit_function_kind kind) {
+  char name[32];
+  snprintf(name, sizeof(name), "bf_chunk%zu", i);
+
+  return declare_kernel(ctx, name, kind);
+}
+
+codegen new_codegen(gcc_jit_context *ctx, gcc_jit_function *fn, runtime *rt,
+                    profile_t *profile, gcc_jit_location **locs) {
+  gcc_jit_type *int_type = gcc_jit_context_get_type(ctx, GCC_JIT_TYPE_INT);
+  gcc_jit_type *cell_type = gcc_jit_context_get_type(ctx, GCC_JIT_TYPE_UINT8_T);
+
+  codegen cg = {
+    .ctx = ctx,
+    .fn = fn,
+    .int_type = int_type,
+    .cell_type = cell_type,
+    .tape = gcc_jit_param_as_rvalue(gcc_jit_function_get_param(fn, 0)),
+    .index = gcc_jit_function_new_local(fn, NULL, int_type, "index"),
+    .rt = rt,
+    .profile = profile,
+    .locs = locs,
+  };
+
+  if (profile)
+    cg.expect = gcc_jit_context_get_builtin_function(ctx, "__builtin_expect");
+
+  if (!rt) {
+    cg.get = gcc_jit_param_as_rvalue(gcc_jit_function_get_param(fn, 1));
+    cg.put = gcc_jit_param_as_rvalue(gcc_jit_function_get_param(fn, 2));
+    cg.io = gcc_jit_param_as_rvalue(gcc_jit_function_get_param(fn, 3));
+  }
+
+  return cg;
+}
+
+gcc_jit_block *gen_ops(codegen *cg, gcc_jit_block *block, program_t *program,
+                       size_t start, size_t end);
+
+// Emits the loop opened by ops[start], whose pointer move is already done
+gcc_jit_block *gen_loop(codegen *cg, gcc_jit_block *block, program_t *program,
+                        size_t start) {
+  op *p = &program->ops[start];
+  size_t end = p->arg;
+
+  gcc_jit_block *body = gcc_jit_function_new_block(cg->fn, "loop_body");
+  gcc_jit_block *after = gcc_jit_function_new_block(cg->fn, "loop_end");
+
+  // Loops that never ran while profiling are treated as cold
+  loop_profile *l =
+      cg->profile ? find_loop_profile(cg->profile, p->pos) : NULL;
+  gcc_jit_rvalue *cond = cell_cmp(cg, GCC_JIT_COMPARISON_EQ);
+  if (l)
+    cond = l->entries ? expect(cg, cond, l->skips, l->entries)
+                      : expect(cg, cond, 1, 1);
+
+  gcc_jit_block_end_with_conditional(block, cg->loc, cond, after, body);
+
+  // Unrolled copies would hide back edges from --progress
+  bool progress = cg->rt && cg->rt->report;
+  block = body;
+  int copies = progress ? 1 : unroll_factor(l, end - start - 1);
+  for (int i = copies; i > 0; i--) {
+    block = gen_ops(cg, block, program, start + 1, end);
+    locate(cg, end);
+    move(cg, block, program->ops[end].offset);
+
+    if (i > 1) {
+      gcc_jit_block *next = gcc_jit_function_new_block(cg->fn, "loop_body");
+      gcc_jit_block_end_with_conditional(
+          block, cg->loc, cell_cmp(cg, GCC_JIT_COMPARISON_NE), next, after);
+      block = next;
+    }
+  }
+
+  cond = cell_cmp(cg, GCC_JIT_COMPARISON_NE);
+  if (l)
+    cond = expect(cg, cond, l->backedges,
+                  l->backedges + l->entries - l->skips);
+
+  if (progress) {
+    gcc_jit_block *latch = gcc_jit_function_new_block(cg->fn, "loop_latch");
+    gcc_jit_block_end_with_conditional(block, cg->loc, cond, latch, after);
+
+    latch = emit_progress(cg, latch, program->ops[end].pos);
+    gcc_jit_block_end_with_jump(latch, cg->loc, body);
+  } else {
+    gcc_jit_block_end_with_conditional(block, cg->loc, cond, body, after);
+  }
+
+  return after;
+}
+
+/*
+ * Outlined loops are functions of the tape and index, like chunks, that
+ * return the index. They are defined in the current context the first
+ * time one of their occurrences is lowered.
+ */
+gcc_jit_block *call_outlined(codegen *cg, gcc_jit_block *block,
+                             program_t *program, size_t k) {
+  size_t rep = cg->loop_ids[k];
+  gcc_jit_function *fn = cg->outlined[rep];
+
+  if (!fn) {
+    char name[32];
+    snprintf(name, sizeof(name), "bf_loop%zu", rep);
+    fn = cg->outlined[rep] =
+        declare_kernel(cg->ctx, name, GCC_JIT_FUNCTION_INTERNAL);
+
+    codegen sub = new_codegen(cg->ctx, fn, cg->rt, cg->profile, cg->locs);
+    sub.loop_ids = cg->loop_ids;
+    sub.outlined = cg->outlined;
+
+    gcc_jit_block *entry = gcc_jit_function_new_block(fn, "entry");
+    gcc_jit_block_add_assignment(
+        entry, NULL, sub.index,
+        gcc_jit_param_as_rvalue(gcc_jit_function_get_param(fn, 1)));
+
+    locate(&sub, rep);
+    entry = gen_loop(&sub, entry, program, rep);
+    gcc_jit_block_end_with_return(entry, NULL,
+                                  gcc_jit_lvalue_as_rvalue(sub.index));
+  }
+
+  gcc_jit_rvalue *args[2] = { cg->tape, gcc_jit_lvalue_as_rvalue(cg->index) };
+  gcc_jit_block_add_assignment(
+      block, cg->loc, cg->index,
+      gcc_jit_context_new_call(cg->ctx, cg->loc, fn, 2, args));
+
+  return block;
+}
+
+/*
+ * Lowers ops [start, end) into `block` and returns the block that
+ * control falls through to afterwards. Loops are emitted rotated, with
+ * the condition tested both on entry and on the back edge, so that every
+ * loop costs two blocks; scans get the same shape around a single
+ * pointer increment.
+ */
+gcc_jit_block *gen_ops(codegen *cg, gcc_jit_block *block, program_t *program,
+                       size_t start, size_t end) {
+  gcc_jit_rvalue *arg;
+  gcc_jit_block *body, *after;
+
+  for (size_t k = start; k < end; k++) {
+    op *p = &program->ops[k];
+    locate(cg, k);
+    move(cg, block, p->offset);
+
+    switch (p->code) {
+      case SET:
+        gcc_jit_block_add_assignment(block, cg->loc, cell_at(cg, 0),
+                                     cell_const(cg, p->arg));
+        break;
+      case ZEROSEEK:
+        body = gcc_jit_function_new_block(cg->fn, "scan");
+        after = gcc_jit_function_new_block(cg->fn, "scan_end");
+
+        gcc_jit_block_end_with_conditional(
+            block, cg->loc, cell_cmp(cg, GCC_JIT_COMPARISON_EQ), after, body);
+        move(cg, body, p->arg);
+        gcc_jit_block_end_with_conditional(
+            body, cg->loc, cell_cmp(cg, GCC_JIT_COMPARISON_NE), body, after);
+
+        block = after;
+        break;
+      case MUL:
+        arg = gcc_jit_context_new_binary_op(
+            cg->ctx, cg->loc, GCC_JIT_BINARY_OP_MULT, cg->cell_type,
+            gcc_jit_lvalue_as_rvalue(cell_at(cg, 0)), cell_const(cg, p->arg));
+        gcc_jit_block_add_assignment_op(block, cg->loc, cell_at(cg, p->dst),
+                                        GCC_JIT_BINARY_OP_PLUS, arg);
+        break;
+      case ADD:
+        gcc_jit_block_add_assignment_op(block, cg->loc, cell_at(cg, 0),
+                                        GCC_JIT_BINARY_OP_PLUS,
+                                        cell_const(cg, p->arg));
+        break;
+      case MINUS:
+        gcc_jit_block_add_assignment_op(block, cg->loc, cell_at(cg, 0),
+                                        GCC_JIT_BINARY_OP_MINUS,
+                                        cell_const(cg, p->arg));
+        break;
+      case READ:
+        block = emit_get(cg, block);
+        break;
+      case PUT:
+        block = emit_put(cg, block);
+        break;
+      case JMP_FWD:
+        if (cg->outlined && cg->loop_ids[k] != NO_LOOP)
+          block = call_outlined(cg, block, program, k);
+        else
+          block = gen_loop(cg, block, program, k);
+
+        k = p->arg;
+        break;
+      default:
+        break;
+    }
+  }
+
+  return block;
+}
+
+/*
+ * Declares the compiled program. Executables and -e use a plain
+ * `bf_program(tape)` calling into libc for I/O, while object files and
+ * libraries export the callback based entry point described in bf.h.
+ */
+gcc_jit_function *declare_program(gcc_jit_context *ctx, char *name,
+                                  bool callbacks) {
+  gcc_jit_type *void_type = gcc_jit_context_get_type(ctx, GCC_JIT_TYPE_VOID);
+  gcc_jit_type *void_ptr = gcc_jit_context_get_type(ctx, GCC_JIT_TYPE_VOID_PTR);
+  gcc_jit_type *int_type = gcc_jit_context_get_type(ctx, GCC_JIT_TYPE_INT);
+  gcc_jit_type *cell_type = gcc_jit_context_get_type(ctx, GCC_JIT_TYPE_UINT8_T);
+
+  gcc_jit_type *put_params[2] = { int_type, void_ptr };
+  gcc_jit_param *params[4] = {
+    gcc_jit_context_new_param(ctx, NULL, gcc_jit_type_get_pointer(cell_type),
+                              "tape"),
+  };
+
+  if (callbacks) {
+    params[1] = gcc_jit_context_new_param(
+        ctx, NULL,
+        gcc_jit_context_new_function_ptr_type(ctx, NULL, int_type, 1,
+                                              &void_ptr, 0),
+        "get");
+    params[2] = gcc_jit_context_new_param(
+        ctx, NULL,
+        gcc_jit_context_new_function_ptr_type(ctx, NULL, void_type, 2,
+                                              put_params, 0),
+        "put");
+    params[3] = gcc_jit_context_new_param(ctx, NULL, void_ptr, "io");
+  }
+
+  return gcc_jit_context_new_function(ctx, NULL, GCC_JIT_FUNCTION_EXPORTED,
+                                      void_type, name, callbacks ? 4 : 1,
+                                      params, 0);
+}
+
+char *source_path(char *file) {
+  char *path;
+  if (!(path = realpath(file, NULL)))
+    return file;
+
+  return path;
+}
+
+/*
+ * Maps every op to the line and column of its source byte, so that
+ * debuggers and perf can attribute generated code to the .bf file.
+ */
+gcc_jit_location **locate_ops(gcc_jit_context *ctx, program_t *program,
+                              char *source, char *file) {
+  gcc_jit_location **locs;
+  if (!(locs = malloc(program->n * sizeof(gcc_jit_location *))))
+    err(EXIT_FAILURE, NULL);
+
+  int line = 1, column = 1;
+  size_t pos = 0;
+  for (size_t k = 0; k < program->n; k++) {
+    for (; pos < program->ops[k].pos && source[pos]; pos++) {
+      if (source[pos] == '\n') {
+        line++;
+        column = 1;
+      } else {
+        column++;
+      }
+    }
+
+    locs[k] = gcc_jit_context_new_location(ctx, file, line, column);
+  }
+
+  return locs;
+}
+
+/*
+ * Without scans and with every loop body moving the pointer by zero in
+ * total, the pointer position of each op is a compile-time constant.
+ * Returns whether that holds and the range of cells touched.
+ */
+bool static_extent(program_t *program, ssize_t *lo, ssize_t *hi) {
+  ssize_t pos = 0, loops[STACK_SIZE];
+  size_t depth = 0;
+
+  *lo = *hi = 0;
+  for (op *p = program->ops; p->code != END; p++) {
+    pos += p->offset;
+
+    ssize_t touched[2] = { pos, p->code == MUL ? pos + p->dst : pos };
+    for (int i = 0; i < 2; i++) {
+      if (touched[i] < *lo)
+        *lo = touched[i];
+      if (touched[i] > *hi)
+        *hi = touched[i];
+    }
+
+    if (p->code == ZEROSEEK)
+      return false;
+    else if (p->code == JMP_FWD)
+      loops[depth++] = pos;
+    else if (p->code == JMP_BCK && loops[--depth] != pos)
+      return false;
+  }
+
+  return true;
+}
+
+// Copies promoted cells from the tape, or back to it
+void sync_cells(codegen *cg, gcc_jit_block *block, bool load) {
+  for (size_t i = 0; i < cg->ncells; i++) {
+    gcc_jit_lvalue *mem = gcc_jit_context_new_array_access(
+        cg->ctx, NULL, cg->tape,
+        gcc_jit_context_new_rvalue_from_int(cg->ctx, cg->int_type,
+                                            cg->base + (ssize_t) i));
+
+    if (load)
+      gcc_jit_block_add_assignment(block, NULL, cg->cells[i],
+                                   gcc_jit_lvalue_as_rvalue(mem));
+    else
+      gcc_jit_block_add_assignment(block, NULL, mem,
+                                   gcc_jit_lvalue_as_rvalue(cg->cells[i]));
+  }
+}
+
+/*
+ * Programs confined to a few statically known cells get one local per
+ * cell, loaded from the tape on entry and stored back on exit, so GCC
+ * can keep them in registers.
+ */
+void promote_cells(codegen *cg, gcc_jit_block *block, ssize_t lo, ssize_t hi) {
+  cg->ncells = hi - lo + 1;
+  if (!(cg->cells = malloc(cg->ncells * sizeof(gcc_jit_lvalue *))))
+    err(EXIT_FAILURE, NULL);
+
+  for (size_t i = 0; i < cg->ncells; i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "cell%zd", lo + (ssize_t) i);
+    cg->cells[i] =
+        gcc_jit_function_new_local(cg->fn, NULL, cg->cell_type, name);
+  }
+
+  cg->base = lo;
+  cg->pos = 0;
+  sync_cells(cg, block, true);
+}
+
+void gen_instructions(gcc_jit_context *ctx, gcc_jit_function *fn,
+                      program_t *program, runtime *rt, profile_t *profile,
+                      gcc_jit_location **locs, size_t *loop_ids) {
+  codegen cg = new_codegen(ctx, fn, rt, profile, locs);
+
+  gcc_jit_block *block = gcc_jit_function_new_block(fn, "entry");
+  gcc_jit_block_add_assignment(block, NULL, cg.index,
+                               gcc_jit_context_zero(ctx, cg.int_type));
+
+  // The extent includes cells only reached in loops that never run, such
+  // as a leading comment, so it may reach outside the tape
+  ssize_t lo, hi;
+  bool scalar = static_extent(program, &lo, &hi) && lo >= 0 &&
+                hi < TAPE_SIZE && hi - lo < MAX_SCALAR_CELLS;
+  if (scalar)
+    promote_cells(&cg, block, lo, hi);
+
+  // Outlined loops use the buffered runtime rather than the callbacks
+  if (loop_ids && rt && !scalar) {
+    cg.loop_ids = loop_ids;
+    if (!(cg.outlined = calloc(program->n, sizeof(gcc_jit_function *))))
+      err(EXIT_FAILURE, NULL);
+  }
+
+  block = gen_ops(&cg, block, program, 0, program->n - 1);
+
+  if (scalar)
+    sync_cells(&cg, block, false);
+
+  gcc_jit_block_end_with_void_return(block, NULL);
+}
+
+void gen_chunk(gcc_jit_context *ctx, gcc_jit_function *fn, program_t *program,
+               runtime *rt, profile_t *profile, gcc_jit_location **locs,
+               size_t start, size_t end) {
+  codegen cg = new_codegen(ctx, fn, rt, profile, locs);
+
+  gcc_jit_block *block = gcc_jit_function_new_block(fn, "entry");
+  gcc_jit_block_add_assignment(
+      block, NULL, cg.index,
+      gcc_jit_param_as_rvalue(gcc_jit_function_get_param(fn, 1)));
+
+  block = gen_ops(&cg, block, program, start, end);
+  gcc_jit_block_end_with_return(block, NULL,
+                                gcc_jit_lvalue_as_rvalue(cg.index));
+}
+
+/*
+ * The tape of executables is offset by one cell, see define_main(), so
+ * the program's cell i is state->tape[i + 1].
+ */
+bool in_tape(ssize_t i) {
+  return i >= 0 && i < TAPE_SIZE - 1;
+}
+
+bool append_output(prefix *state, uint8_t c) {
+  if (state->len == state->cap) {
+    if (state->cap == PREFIX_MAX_OUTPUT)
+      return false;
+
+    state->cap = state->cap ? state->cap * 2 : 4096;
+    if (!(state->output = realloc(state->output, state->cap)))
+      err(EXIT_FAILURE, NULL);
+  }
+
+  state->output[state->len++] = c;
+  return true;
+}
+
+/*
+ * Runs the program at compile time until it reads input, leaves the
+ * tape, fills the output limit or runs out of steps. state->pc is the op
+ * to resume at, before its pointer move.
+ */
+void partial_eval(program_t *program, prefix *state, size_t steps) {
+  uint8_t *cells = state->tape + 1;
+
+  for (size_t k = 0;; k++) {
+    op *p = &program->ops[k];
+    ssize_t i = state->index + p->offset;
+    state->pc = k;
+
+    if (p->code == END || p->code == READ || steps-- == 0 || !in_tape(i))
+      return;
+
+    switch (p->code) {
+      case SET:
+        cells[i] = p->arg;
+        break;
+      case ZEROSEEK:
+        while (cells[i] != 0) {
+          i += p->arg;
+          if (!in_tape(i))
+            return;
+        }
+        break;
+      case MUL:
+        if (!in_tape(i + p->dst))
+          return;
+        cells[i + p->dst] += cells[i] * p->arg;
+        break;
+      case ADD:
+        cells[i] += p->arg;
+        break;
+      case MINUS:
+        cells[i] -= p->arg;
+        break;
+      case PUT:
+        if (!append_output(state, cells[i]))
+          return;
+        break;
+      case JMP_FWD:
+        if (cells[i] == 0)
+          k = p->arg;
+        break;
+      case JMP_BCK:
+        if (cells[i] != 0)
+          k = p->arg;
+        break;
+      default:
+        break;
+    }
+
+    state->index = i;
+  }
+}
+
+/*
+ * Generates the rest of the program from state->pc onwards. Loops that
+ * enclose pc are resumed at pc and then continue as ordinary loops, which
+ * are only ever re-entered through their back edge.
+ */
+void gen_residual(gcc_jit_context *ctx, gcc_jit_function *fn,
+                  program_t *program, runtime *rt, profile_t *profile,
+                  gcc_jit_location **locs, prefix *state) {
+  codegen cg = new_codegen(ctx, fn, rt, profile, locs);
+
+  gcc_jit_block *block = gcc_jit_function_new_block(fn, "entry");
+  gcc_jit_block_add_assignment(
+      block, NULL, cg.index,
+      gcc_jit_context_new_rvalue_from_int(ctx, cg.int_type, state->index));
+
+  size_t *loops, depth = 0;
+  if (!(loops = malloc(program->n * sizeof(size_t))))
+    err(EXIT_FAILURE, NULL);
+
+  for (size_t k = 0; k < state->pc; k++) {
+    if (program->ops[k].code == JMP_FWD)
+      loops[depth++] = k;
+    else if (program->ops[k].code == JMP_BCK)
+      depth--;
+  }
+
+  size_t from = state->pc;
+  while (depth-- > 0) {
+    size_t fwd = loops[depth], bck = program->ops[fwd].arg;
+    block = gen_ops(&cg, block, program, from, bck);
+    move(&cg, block, program->ops[bck].offset);
+
+    // The pointer is already where the loop tests it, so skip the move
+    // that gen_ops would make before entering it
+    locate(&cg, fwd);
+    block = gen_loop(&cg, block, program, fwd);
+    from = bck + 1;
+  }
+
+  block = gen_ops(&cg, block, program, from, program->n - 1);
+  gcc_jit_block_end_with_void_return(block, NULL);
+
+  free(loops);
+}
+
+// Calls every chunk in order, threading the tape index through
+void gen_driver(gcc_jit_context *ctx, gcc_jit_function *fn, size_t n) {
+  gcc_jit_type *int_type = gcc_jit_context_get_type(ctx, GCC_JIT_TYPE_INT);
+  gcc_jit_lvalue *index =
+      gcc_jit_function_new_local(fn, NULL, int_type, "index");
 
-typedef struct {
-  gcc_jit_block *start, *end;
-} jmp_pair;
+  gcc_jit_block *block = gcc_jit_function_new_block(fn, "entry");
+  gcc_jit_block_add_assignment(block, NULL, index,
+                               gcc_jit_context_zero(ctx, int_type));
+
+  for (size_t i = 0; i < n; i++) {
+    gcc_jit_rvalue *args[2] = {
+      gcc_jit_param_as_rvalue(gcc_jit_function_get_param(fn, 0)),
+      gcc_jit_lvalue_as_rvalue(index),
+    };
+    gcc_jit_block_add_assignment(
+        block, NULL, index,
+        gcc_jit_context_new_call(
+            ctx, NULL, declare_chunk(ctx, i, GCC_JIT_FUNCTION_IMPORTED), 2,
+            args));
+  }
+
+  gcc_jit_block_end_with_void_return(block, NULL);
+}
+
+/*
+ * Splits the program at top-level loop boundaries into at most n chunks
+ * of roughly equal size. bounds[i] and bounds[i + 1] delimit chunk i.
+ */
+size_t split_program(program_t *program, size_t n, size_t *bounds) {
+  size_t end = program->n - 1, target = end / n + 1, chunks = 0;
+
+  bounds[0] = 0;
+  for (size_t k = 0; k < end; k++) {
+    if (program->ops[k].code == JMP_FWD)
+      k = program->ops[k].arg;
+
+    if (k + 1 - bounds[chunks] >= target && chunks + 1 < n)
+      bounds[++chunks] = k + 1;
+  }
+
+  if (bounds[chunks] < end)
+    chunks++;
+
+  bounds[chunks] = end;
+  return chunks;
+}
+
+void compile_to_file(gcc_jit_context *ctx, enum gcc_jit_output_kind kind,
+                     const char *path) {
+  PROBE1(compile__start, kind);
+  gcc_jit_context_compile_to_file(ctx, kind, path);
+  PROBE1(compile__done, kind);
+}
+
+void chunk_path(char *dir, size_t i, enum gcc_jit_output_kind kind,
+                char *path) {
+  snprintf(path, PATH_MAX, "%s/chunk%zu.%s", dir, i,
+           kind == GCC_JIT_OUTPUT_KIND_OBJECT_FILE ? "o" : "so");
+}
 
+int compile_chunk(gcc_jit_context *ctx, program_t *program, profile_t *profile,
+                  gcc_jit_location **locs, size_t *bounds, size_t i, char *dir,
+                  enum gcc_jit_output_kind kind) {
+  gcc_jit_context *child = gcc_jit_context_new_child_context(ctx);
+
+  runtime *rt = declare_runtime(child, GCC_JIT_GLOBAL_IMPORTED);
+  gcc_jit_function *fn = declare_chunk(child, i, GCC_JIT_FUNCTION_EXPORTED);
+  gen_chunk(child, fn, program, rt, profile, locs, bounds[i], bounds[i + 1]);
+
+  char path[PATH_MAX];
+  chunk_path(dir, i, kind, path);
+  compile_to_file(child, kind, path);
+
+  return gcc_jit_context_get_first_error(child) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// Forked compilation workers that have not been reaped yet
 typedef struct {
-  jmp_pair data[STACK_SIZE];
-  size_t len;
-} lifo;
+  pid_t pids[MAX_JOBS];
+  size_t n;
+} workers;
 
-typedef void (*BF_program)(uint8_t *);
+/*
+ * Reaps one worker. If it failed, the others are killed and reaped
+ * before exiting so that none is left writing to the output directory.
+ */
+void wait_worker(workers *w) {
+  int status;
+  pid_t pid;
+  if ((pid = wait(&status)) < 0)
+    err(EXIT_FAILURE, NULL);
 
-static const char *progname;
+  for (size_t i = 0; i < w->n; i++) {
+    if (w->pids[i] == pid) {
+      w->pids[i] = w->pids[--w->n];
+      break;
+    }
+  }
 
-static struct option longopts[] = {
-  {"help",     no_argument,       NULL, 'h'},
-  { "dump",    no_argument,       NULL, 'd'},
-  { "execute", no_argument,       NULL, 'e'},
-  { "outfile", required_argument, NULL, 'o'},
-  { "version", no_argument,       NULL, 'v'},
-  { NULL,      no_argument,       NULL, 0  }
-};
+  if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS)
+    return;
 
-void version(void) {
-  printf("-[----->+<]>---.--.++.--.+++.----.+++[->++<]>+.++++++++++"
-         "+ +++.+++++.>++++++++++.\n");
+  for (size_t i = 0; i < w->n; i++)
+    kill(w->pids[i], SIGKILL);
+  while (w->n > 0 && wait(NULL) > 0)
+    w->n--;
+
+  errx(EXIT_FAILURE, "Compilation worker failed");
 }
 
-void usage(FILE *stream) {
-  fprintf(stream, "Usage: %s [option] [-o outfile] [infile]\n", progname);
+/*
+ * libgccjit serializes compilation within a process behind a global
+ * lock, so chunks are compiled by forked workers rather than threads.
+ * Each worker compiles a child of ctx, which must hold only options.
+ */
+void compile_chunks(gcc_jit_context *ctx, program_t *program,
+                    profile_t *profile, gcc_jit_location **locs,
+                    size_t *bounds, size_t n, char *dir,
+                    enum gcc_jit_output_kind kind, size_t jobs) {
+  workers w = { .n = 0 };
+  for (size_t i = 0; i < n; i++) {
+    if (w.n == jobs)
+      wait_worker(&w);
+
+    pid_t pid;
+    if ((pid = fork()) < 0)
+      err(EXIT_FAILURE, NULL);
+
+    if (pid == 0)
+      _exit(compile_chunk(ctx, program, profile, locs, bounds, i, dir, kind));
+
+    w.pids[w.n++] = pid;
+  }
+
+  while (w.n > 0)
+    wait_worker(&w);
 }
 
-void help(void) {
-  usage(stdout);
-  printf("\n");
-  printf("Ahead-of-time brainfuck compiler using libgccjit.\n\n"
-         "Options:\n"
-         "  -d, --dump\t\t\t Dump assembly\n"
-         "  -e, --execute\t\t\t JIT interpret without creating executable\n"
-         "  -h, --help\t\t\t Useless help message\n"
-         "  -o, --outfile FILENAME\t Target executable filename\n"
-         "  -v, --version\t\t\t Print version number\n");
+void remove_chunks(char *dir, size_t n, enum gcc_jit_output_kind kind) {
+  char path[PATH_MAX];
+  for (size_t i = 0; i < n; i++) {
+    chunk_path(dir, i, kind, path);
+    unlink(path);
+  }
+
+  rmdir(dir);
+}
+
+size_t parse_count(char *s) {
+  char *end;
+  unsigned long long steps = strtoull(s, &end, 10);
+  if (*end != '\0' || *s == '-' || steps == 0)
+    errx(EXIT_FAILURE, "Invalid count: %s", s);
+
+  return steps;
+}
+
+size_t parse_jobs(char *s) {
+  char *end;
+  long jobs = strtol(s, &end, 10);
+  if (*end != '\0' || jobs < 1 || jobs > MAX_JOBS)
+    errx(EXIT_FAILURE, "Invalid number of jobs: %s", s);
+
+  return jobs;
+}
+
+output_kind parse_output_kind(char *s) {
+  if (strcmp(s, "exe") == 0)
+    return OUTPUT_EXECUTABLE;
+  if (strcmp(s, "obj") == 0)
+    return OUTPUT_OBJECT;
+  if (strcmp(s, "lib") == 0)
+    return OUTPUT_LIBRARY;
+
+  errx(EXIT_FAILURE, "Invalid output kind: %s", s);
+}
+
+int parse_opt_level(char *s) {
+  if (strcmp(s, "auto") == 0)
+    return AUTO_OPT_LEVEL;
+
+  if (s[0] < '0' || s[0] > '3' || s[1] != '\0')
+    errx(EXIT_FAILURE, "Invalid optimization level: %s", s);
+
+  return s[0] - '0';
+}
+
+/*
+ * Picks an optimization level for programs where compile time may
+ * dominate run time. Ops per level of loop nesting approximates how much
+ * straight-line code GCC has to chew through for each hot loop, so long
+ * flat programs are compiled cheaply while deeply nested ones of the
+ * same size keep the expensive passes.
+ */
+int auto_opt_level(program_t *program) {
+  size_t depth = 0, max_depth = 0;
+  for (op *p = program->ops; p->code != END; p++) {
+    if (p->code == JMP_FWD && ++depth > max_depth)
+      max_depth = depth;
+    else if (p->code == JMP_BCK)
+      depth--;
+  }
+
+  size_t weight = program->n / (max_depth + 1);
+  if (weight < 20000)
+    return 3;
+  if (weight < 100000)
+    return 2;
+  if (weight < 500000)
+    return 1;
+
+  return 0;
+}
+
+void add_flag(gcc_jit_context *ctx, char *options, char *flag) {
+  size_t len = strlen(options);
+  if (len + strlen(flag) + 2 > MAX_OPTIONS)
+    errx(EXIT_FAILURE, "Too many compiler flags");
+
+  sprintf(options + len, " %s", flag);
+  gcc_jit_context_add_command_line_option(ctx, flag);
+}
+
+void make_dirs(char *path) {
+  char tmp[PATH_MAX];
+  snprintf(tmp, sizeof(tmp), "%s", path);
+
+  for (char *p = tmp + 1;; p++) {
+    if (*p != '/' && *p != '\0')
+      continue;
+
+    char ch = *p;
+    *p = '\0';
+    if (mkdir(tmp, 0755) < 0 && errno != EEXIST)
+      err(EXIT_FAILURE, "%s", tmp);
+
+    if (!(*p = ch))
+      break;
+  }
+}
+
+/*
+ * Compiled programs are keyed by their source, its parsed IR, the
+ * libgccjit version, CODEGEN_VERSION and the options that affect code
+ * generation. The IR covers changes to parsing and folding in ir.c.
+ */
+void cache_path(char *dir, char *source, program_t *program, char *options,
+                char *path) {
+  char base[PATH_MAX], id[256];
+  char *env;
+
+  if (dir)
+    snprintf(base, sizeof(base), "%s", dir);
+  else if ((env = getenv("XDG_CACHE_HOME")) && *env)
+    snprintf(base, sizeof(base), "%s/bf", env);
+  else if ((env = getenv("HOME")) && *env)
+    snprintf(base, sizeof(base), "%s/.cache/bf", env);
+  else
+    errx(EXIT_FAILURE, "No cache directory, set HOME or pass --cache=DIR");
+
+  make_dirs(base);
+
+  snprintf(id, sizeof(id), "libgccjit %d.%d.%d, %s, codegen %d",
+           gcc_jit_version_major(), gcc_jit_version_minor(),
+           gcc_jit_version_patchlevel(), options, CODEGEN_VERSION);
+
+  uint64_t ir_hash = hash_program(program);
+  uint64_t hash = hash_bytes(FNV_OFFSET, source, strlen(source));
+  hash = hash_bytes(hash, &ir_hash, sizeof(ir_hash));
+  hash = hash_bytes(hash, id, strlen(id));
+
+  if (snprintf(path, PATH_MAX, "%s/%016" PRIx64 ".so", base, hash) >= PATH_MAX)
+    errx(EXIT_FAILURE, "Cache path too long");
+}
+
+BF_program load_cached(char *path) {
+  void *handle;
+  if (!(handle = dlopen(path, RTLD_NOW | RTLD_LOCAL)))
+    return NULL;
+
+  return (BF_program) dlsym(handle, "bf_program");
 }
 
-void gen_instructions(gcc_jit_context *ctx, gcc_jit_function *program,
-                      char *s) {
-  gcc_jit_lvalue *cell;
+void store_cached(gcc_jit_context *ctx, char *path) {
+  char tmp[PATH_MAX + 32];
+  snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, getpid());
+
+  compile_to_file(ctx, GCC_JIT_OUTPUT_KIND_DYNAMIC_LIBRARY, tmp);
+
+  if (rename(tmp, path) < 0)
+    err(EXIT_FAILURE, "%s", path);
+}
+
+/*
+ * With a partially evaluated prefix, the tape snapshot becomes static
+ * data and the prefix output is written in one go before the residual
+ * program runs.
+ */
+void define_main(gcc_jit_context *ctx, gcc_jit_function *program,
+                 runtime *rt, prefix *state) {
   gcc_jit_type *int_type = gcc_jit_context_get_type(ctx, GCC_JIT_TYPE_INT);
   gcc_jit_type *cell_type = gcc_jit_context_get_type(ctx, GCC_JIT_TYPE_UINT8_T);
+  gcc_jit_function *main = gcc_jit_context_new_function(
+      ctx, NULL, GCC_JIT_FUNCTION_EXPORTED, int_type, "main", 0, NULL, 0);
 
-  gcc_jit_block *current_block = gcc_jit_function_new_block(program, "entry");
+  gcc_jit_block *main_block = gcc_jit_function_new_block(main, "program_entry");
 
-  gcc_jit_rvalue *tape =
-      gcc_jit_param_as_rvalue(gcc_jit_function_get_param(program, 0));
-  gcc_jit_lvalue *index =
-      gcc_jit_function_new_local(program, NULL, int_type, "index");
-  gcc_jit_block_add_assignment(current_block, NULL, index,
-                               gcc_jit_context_zero(ctx, int_type));
+  gcc_jit_type *tape_type =
+      gcc_jit_context_new_array_type(ctx, NULL, cell_type, TAPE_SIZE);
 
-  gcc_jit_param *putchar_arg =
-      gcc_jit_context_new_param(ctx, NULL, int_type, "c");
-  gcc_jit_function *builtin_putchar =
-      gcc_jit_context_new_function(ctx, NULL, GCC_JIT_FUNCTION_IMPORTED,
-                                   int_type, "putchar", 1, &putchar_arg, 0);
-  gcc_jit_function *builtin_getchar =
-      gcc_jit_context_new_function(ctx, NULL, GCC_JIT_FUNCTION_IMPORTED,
-                                   int_type, "getchar_unlocked", 0, NULL, 0);
+  gcc_jit_lvalue *tape;
+  if (state) {
+    tape = gcc_jit_context_new_global(ctx, NULL, GCC_JIT_GLOBAL_INTERNAL,
+                                      tape_type, "tape");
+    gcc_jit_global_set_initializer(tape, state->tape, TAPE_SIZE);
+  } else {
+    tape = gcc_jit_function_new_local(main, NULL, tape_type, "tape");
+  }
 
-  gcc_jit_rvalue *call;
-  gcc_jit_rvalue *arg;
+  if (state && state->len) {
+    gcc_jit_lvalue *output = gcc_jit_context_new_global(
+        ctx, NULL, GCC_JIT_GLOBAL_INTERNAL,
+        gcc_jit_context_new_array_type(ctx, NULL, cell_type, state->len),
+        "prefix_output");
+    gcc_jit_global_set_initializer(output, state->output, state->len);
 
-  lifo jmp_stack = { 0 };
+    gcc_jit_rvalue *args[2] = {
+      gcc_jit_lvalue_get_address(
+          gcc_jit_context_new_array_access(
+              ctx, NULL, gcc_jit_lvalue_as_rvalue(output),
+              gcc_jit_context_zero(ctx, int_type)),
+          NULL),
+      gcc_jit_context_new_rvalue_from_long(
+          ctx, gcc_jit_context_get_type(ctx, GCC_JIT_TYPE_SIZE_T), state->len),
+    };
+    gcc_jit_block_add_eval(main_block, NULL,
+                           gcc_jit_context_new_call(ctx, NULL, rt->write, 2,
+                                                    args));
+  }
 
-  int ch;
-  while ((ch = *s++)) {
-    switch (ch) {
-      case '>':
-        gcc_jit_block_add_assignment_op(current_block, NULL, index,
-                                        GCC_JIT_BINARY_OP_PLUS,
-                                        gcc_jit_context_one(ctx, int_type));
-        break;
-      case '<':
-        gcc_jit_block_add_assignment_op(current_block, NULL, index,
-                                        GCC_JIT_BINARY_OP_MINUS,
-                                        gcc_jit_context_one(ctx, int_type));
-        break;
-      case '+':
-        cell = gcc_jit_context_new_array_access(
-            ctx, NULL, tape, gcc_jit_lvalue_as_rvalue(index));
-        gcc_jit_block_add_assignment_op(current_block, NULL, cell,
-                                        GCC_JIT_BINARY_OP_PLUS,
-                                        gcc_jit_context_one(ctx, cell_type));
-        break;
-      case '-':
-        cell = gcc_jit_context_new_array_access(
-            ctx, NULL, tape, gcc_jit_lvalue_as_rvalue(index));
-        gcc_jit_block_add_assignment_op(current_block, NULL, cell,
-                                        GCC_JIT_BINARY_OP_MINUS,
-                                        gcc_jit_context_one(ctx, cell_type));
-        break;
-      case '.':
-        cell = gcc_jit_context_new_array_access(
-            ctx, NULL, tape, gcc_jit_lvalue_as_rvalue(index));
-        arg = gcc_jit_context_new_cast(
-            ctx, NULL, gcc_jit_lvalue_as_rvalue(cell),
-            gcc_jit_context_get_type(ctx, GCC_JIT_TYPE_INT));
-        call = gcc_jit_context_new_call(ctx, NULL, builtin_putchar, 1, &arg);
-        gcc_jit_block_add_eval(current_block, NULL, call);
-        break;
-      case ',':
-        cell = gcc_jit_context_new_array_access(
-            ctx, NULL, tape, gcc_jit_lvalue_as_rvalue(index));
-        call = gcc_jit_context_new_call(ctx, NULL, builtin_getchar, 0, NULL);
-        gcc_jit_block_add_assignment(
-            current_block, NULL, cell,
-            gcc_jit_context_new_cast(ctx, NULL, call, cell_type));
-        break;
-      case '[': {
-        gcc_jit_block *loop_cond =
-            gcc_jit_function_new_block(program, "loop_cond");
-        gcc_jit_block *loop_body =
-            gcc_jit_function_new_block(program, "loop_body");
-        gcc_jit_block *loop_end =
-            gcc_jit_function_new_block(program, "loop_end");
-
-        gcc_jit_block_end_with_jump(current_block, NULL, loop_cond);
-        cell = gcc_jit_context_new_array_access(
-            ctx, NULL, tape, gcc_jit_lvalue_as_rvalue(index));
-        gcc_jit_rvalue *cond = gcc_jit_context_new_comparison(
-            ctx, NULL, GCC_JIT_COMPARISON_EQ, gcc_jit_lvalue_as_rvalue(cell),
-            gcc_jit_context_zero(ctx, cell_type));
-
-        gcc_jit_block_end_with_conditional(loop_cond, NULL, cond, loop_end,
-                                           loop_body);
-        current_block = loop_body;
-        PUSH_STACK(jmp_stack, loop_cond, loop_end);
-        break;
-      }
-      case ']':
-        if (IS_EMPTY_STACK(jmp_stack))
-          errx(EXIT_FAILURE, "Missing opening '['");
+  gcc_jit_lvalue *cell = gcc_jit_context_new_array_access(
+      ctx, NULL, gcc_jit_lvalue_as_rvalue(tape),
+      gcc_jit_context_one(ctx, int_type));
+  gcc_jit_rvalue *ptr = gcc_jit_lvalue_get_address(cell, NULL);
 
-        gcc_jit_block_end_with_jump(current_block, NULL, TOP_START(jmp_stack));
-        current_block = TOP_END(jmp_stack);
+  if (rt->watch)
+    gcc_jit_block_add_eval(main_block, NULL,
+                           gcc_jit_context_new_call(ctx, NULL, rt->watch, 0,
+                                                    NULL));
 
-        POP_STACK(jmp_stack);
-        break;
-      default:
-        break;
-    }
+  gcc_jit_rvalue *args[1] = { ptr };
+  gcc_jit_rvalue *call = gcc_jit_context_new_call(ctx, NULL, program, 1, args);
+  gcc_jit_block_add_eval(main_block, NULL, call);
+  gcc_jit_block_add_eval(main_block, NULL,
+                         gcc_jit_context_new_call(ctx, NULL, rt->flush, 0,
+                                                  NULL));
+  gcc_jit_block_end_with_return(main_block, NULL,
+                                gcc_jit_context_zero(ctx, int_type));
+}
+
+int find_code(struct dl_phdr_info *info, __attribute__((unused)) size_t size,
+              void *data) {
+  uintptr_t *code = data;
+  for (size_t i = 0; i < info->dlpi_phnum; i++) {
+    const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+    uintptr_t start = info->dlpi_addr + phdr->p_vaddr;
+    if (phdr->p_type != PT_LOAD || !(phdr->p_flags & PF_X) ||
+        code[0] < start || code[0] >= start + phdr->p_memsz)
+      continue;
+
+    code[1] = phdr->p_memsz;
+    return 1;
+  }
+
+  return 0;
+}
+
+// Size of the executable segment of the loaded object containing fn
+size_t loaded_code_size(void *fn) {
+  uintptr_t code[2] = { (uintptr_t) fn, 0 };
+  dl_iterate_phdr(find_code, code);
+  return code[1];
+}
+
+void execute(BF_program fn) {
+  uint8_t tape[TAPE_SIZE] = { 0 };
+  stats.code_size = loaded_code_size((void *) fn);
+
+  PROBE(run__start);
+  uint64_t start = monotonic_ns();
+  start_counters();
+  fn(tape);
+  rt_flush();
+  stop_counters();
+  stats.run = monotonic_ns() - start;
+  PROBE(run__done);
+}
+
+// All chunks are loaded up front to keep dlopen out of the measured run
+void execute_chunks(char *dir, size_t n) {
+  uint8_t tape[TAPE_SIZE] = { 0 };
+  BF_chunk chunks[MAX_JOBS];
+  int index = 0;
+
+  stats.code_size = 0;
+  for (size_t i = 0; i < n; i++) {
+    char path[PATH_MAX], name[32];
+    chunk_path(dir, i, GCC_JIT_OUTPUT_KIND_DYNAMIC_LIBRARY, path);
+    snprintf(name, sizeof(name), "bf_chunk%zu", i);
+
+    void *handle;
+    if (!(handle = dlopen(path, RTLD_NOW | RTLD_LOCAL)) ||
+        !(chunks[i] = (BF_chunk) dlsym(handle, name)))
+      errx(EXIT_FAILURE, "%s", dlerror());
+
+    stats.code_size += loaded_code_size((void *) chunks[i]);
   }
 
-  if (!IS_EMPTY_STACK(jmp_stack))
-    errx(EXIT_FAILURE, "Missing closing ']'");
+  PROBE(run__start);
+  uint64_t start = monotonic_ns();
+  start_counters();
+  for (size_t i = 0; i < n; i++)
+    index = chunks[i](tape, index);
 
-  gcc_jit_block_end_with_void_return(current_block, NULL);
+  rt_flush();
+  stop_counters();
+  stats.run = monotonic_ns() - start;
+  PROBE(run__done);
 }
 
 void read_file(char *file, char *buffer) {
@@ -225,18 +1888,157 @@ void read_file(char *file, char *buffer) {
     err(EXIT_FAILURE, NULL);
 }
 
+void output_path(char *outdir, char *file, output_kind kind, char *path) {
+  char name[PATH_MAX];
+  snprintf(name, sizeof(name), "%s", basename(file));
+
+  char *ext = strrchr(name, '.');
+  if (ext && ext != name)
+    *ext = '\0';
+
+  const char *suffix = "";
+  if (kind == OUTPUT_OBJECT)
+    suffix = ".o";
+  else if (kind == OUTPUT_LIBRARY)
+    suffix = ".so";
+
+  if (snprintf(path, PATH_MAX, "%s/%s%s", outdir, name, suffix) >= PATH_MAX)
+    errx(EXIT_FAILURE, "Output path too long");
+}
+
+int compile_file(gcc_jit_context *ctx, runtime *rt, char *file, char *outdir,
+                 output_kind kind, char *symbol, int opt_level, bool debug) {
+  char *buffer;
+  if (!(buffer = calloc(MAX_FILE_SIZE, 1)))
+    err(EXIT_FAILURE, NULL);
+
+  read_file(file, buffer);
+  program_t *ir = parse(buffer);
+
+  gcc_jit_context *child = gcc_jit_context_new_child_context(ctx);
+  if (opt_level == AUTO_OPT_LEVEL)
+    gcc_jit_context_set_int_option(
+        child, GCC_JIT_INT_OPTION_OPTIMIZATION_LEVEL, auto_opt_level(ir));
+
+  bool callbacks = kind != OUTPUT_EXECUTABLE;
+  gcc_jit_function *program =
+      declare_program(child, callbacks ? symbol : "bf_program", callbacks);
+  gcc_jit_location **locs =
+      debug ? locate_ops(child, ir, buffer, source_path(file)) : NULL;
+  gen_instructions(child, program, ir, rt, NULL, locs, NULL);
+
+  enum gcc_jit_output_kind output = GCC_JIT_OUTPUT_KIND_EXECUTABLE;
+  if (kind == OUTPUT_OBJECT)
+    output = GCC_JIT_OUTPUT_KIND_OBJECT_FILE;
+  else if (kind == OUTPUT_LIBRARY)
+    output = GCC_JIT_OUTPUT_KIND_DYNAMIC_LIBRARY;
+  else
+    define_main(child, program, rt, NULL);
+
+  char path[PATH_MAX];
+  output_path(outdir, file, kind, path);
+  compile_to_file(child, output, path);
+
+  if (gcc_jit_context_get_first_error(child))
+    return EXIT_FAILURE;
+
+  return EXIT_SUCCESS;
+}
+
+int compare_paths(const void *a, const void *b) {
+  return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/*
+ * Output names only keep the basename of each input, so a/x.bf and
+ * b/x.bf would both be written to outdir/x, concurrently with -j.
+ */
+void check_output_paths(char **files, size_t n, char *outdir,
+                        output_kind kind) {
+  char **paths;
+  if (!(paths = malloc(n * sizeof(char *))))
+    err(EXIT_FAILURE, NULL);
+
+  for (size_t i = 0; i < n; i++) {
+    if (!(paths[i] = malloc(PATH_MAX)))
+      err(EXIT_FAILURE, NULL);
+    output_path(outdir, files[i], kind, paths[i]);
+  }
+
+  qsort(paths, n, sizeof(char *), compare_paths);
+  for (size_t i = 1; i < n; i++)
+    if (strcmp(paths[i - 1], paths[i]) == 0)
+      errx(EXIT_FAILURE, "Several inputs would be compiled to %s", paths[i]);
+
+  for (size_t i = 0; i < n; i++)
+    free(paths[i]);
+  free(paths);
+}
+
+/*
+ * Compiles every file into outdir with up to jobs forked workers. The
+ * buffered runtime and _start are built once in the parent context and
+ * shared by the child context of each file.
+ */
+void compile_batch(gcc_jit_context *ctx, char **files, size_t n,
+                   char *outdir, output_kind kind, char *symbol,
+                   int opt_level, bool freestanding, bool debug,
+                   size_t jobs) {
+  check_output_paths(files, n, outdir, kind);
+  make_dirs(outdir);
+
+  if (opt_level != AUTO_OPT_LEVEL)
+    gcc_jit_context_set_int_option(ctx, GCC_JIT_INT_OPTION_OPTIMIZATION_LEVEL,
+                                   opt_level);
+
+  runtime *rt = NULL;
+  if (kind == OUTPUT_EXECUTABLE) {
+    rt = declare_runtime(ctx, GCC_JIT_GLOBAL_INTERNAL);
+    define_runtime(ctx, rt, freestanding);
+  }
+
+  if (freestanding)
+    define_start(ctx);
+
+  workers w = { .n = 0 };
+  for (size_t i = 0; i < n; i++) {
+    if (w.n == jobs)
+      wait_worker(&w);
+
+    pid_t pid;
+    if ((pid = fork()) < 0)
+      err(EXIT_FAILURE, NULL);
+
+    if (pid == 0)
+      _exit(compile_file(ctx, rt, files[i], outdir, kind, symbol, opt_level,
+                         debug));
+
+    w.pids[w.n++] = pid;
+  }
+
+  while (w.n > 0)
+    wait_worker(&w);
+}
+
 int main(int argc, char *argv[]) {
   unsetenv("POSIXLY_CORRECT");
   progname = basename(argv[0]);
 
   gcc_jit_context *ctx = gcc_jit_context_acquire();
 
-  gcc_jit_context_set_int_option(ctx, GCC_JIT_INT_OPTION_OPTIMIZATION_LEVEL, 3);
-  char *outfile = "bf.out";
-  bool interpret = false;
+  char options[MAX_OPTIONS] = "";
+  int opt_level = 3;
+  size_t jobs = 1, steps = 0, outline = 0;
+  char *outfile = NULL, *cache_dir = NULL, *symbol = "bf_program";
+  char *outdir = NULL;
+  bool interpret = false, cache = false, freestanding = false;
+  bool debug = false, progress = false, counters = false;
+  output_kind kind = OUTPUT_EXECUTABLE;
+  profile_t *profile = NULL;
 
   int opt;
-  while ((opt = getopt_long(argc, argv, "hdevo:", longopts, NULL)) != -1) {
+  const char *optstring = "c::C::hdD:ef:Fgj:k:O:o:p::P:rS::s:U::v";
+  while ((opt = getopt_long(argc, argv, optstring, longopts, NULL)) != -1) {
     switch (opt) {
       case 'h':
         help();
@@ -244,16 +2046,71 @@ int main(int argc, char *argv[]) {
       case 'v':
         version();
         exit(EXIT_SUCCESS);
+      case 'c':
+        cache = true;
+        cache_dir = optarg;
+        break;
+      case 'C':
+        counters = true;
+        enable_counters("aot", parse_stats_format(optarg));
+        break;
       case 'd':
         gcc_jit_context_set_bool_option(
             ctx, GCC_JIT_BOOL_OPTION_DUMP_GENERATED_CODE, 1);
         break;
+      case 'D':
+        outdir = optarg;
+        break;
       case 'e':
         interpret = true;
         break;
+      case 'f':
+        add_flag(ctx, options, optarg);
+        break;
+      case 'F':
+        freestanding = true;
+        break;
+      case 'g':
+        debug = true;
+        gcc_jit_context_set_bool_option(ctx, GCC_JIT_BOOL_OPTION_DEBUGINFO, 1);
+        snprintf(options + strlen(options), MAX_OPTIONS - strlen(options),
+                 " -g");
+        break;
+      case 'j':
+        jobs = parse_jobs(optarg);
+        break;
+      case 'k':
+        kind = parse_output_kind(optarg);
+        break;
+      case 'O':
+        opt_level = parse_opt_level(optarg);
+        break;
       case 'o':
         outfile = optarg;
         break;
+      case 'p':
+        steps = optarg ? parse_count(optarg) : PREFIX_STEPS;
+        break;
+      case 'P':
+        profile = read_profile(optarg);
+        break;
+      case 'r':
+        progress = true;
+        rt_watch_progress();
+        snprintf(options + strlen(options), MAX_OPTIONS - strlen(options),
+                 " -r");
+        break;
+      case 'S':
+        enable_stats("aot", parse_stats_format(optarg));
+        break;
+      case 's':
+        symbol = optarg;
+        break;
+      case 'U':
+        outline = optarg ? parse_count(optarg) : OUTLINE_MIN_OPS;
+        snprintf(options + strlen(options), MAX_OPTIONS - strlen(options),
+                 " -U%zu", outline);
+        break;
       default:
         usage(stderr);
         exit(EXIT_FAILURE);
@@ -265,63 +2122,230 @@ int main(int argc, char *argv[]) {
     errx(EXIT_FAILURE, "No input file");
   }
 
+  if (cache && !interpret)
+    errx(EXIT_FAILURE, "--cache requires --execute");
+
+  if (counters && !interpret)
+    errx(EXIT_FAILURE, "--perf-counters requires --execute");
+
+  if (interpret && kind != OUTPUT_EXECUTABLE)
+    errx(EXIT_FAILURE, "--execute cannot be combined with --kind");
+
+  if (freestanding && (interpret || kind != OUTPUT_EXECUTABLE))
+    errx(EXIT_FAILURE, "--freestanding only applies to executables");
+
+#ifndef __x86_64__
+  if (freestanding)
+    errx(EXIT_FAILURE, "--freestanding is only supported on x86-64");
+#endif
+
+  if (outdir || argc - optind > 1) {
+    if (interpret || outfile || profile || steps || outline || progress)
+      errx(EXIT_FAILURE, "Multiple inputs cannot be combined with --execute, "
+                         "--outfile, --outline, --partial-eval, "
+                         "--profile-use or --progress");
+
+    if (freestanding)
+      add_freestanding_options(ctx);
+
+    uint64_t start = monotonic_ns();
+    compile_batch(ctx, argv + optind, argc - optind, outdir ? outdir : ".",
+                  kind, symbol, opt_level, freestanding, debug, jobs);
+    stats.compile = monotonic_ns() - start;
+    return 0;
+  }
+
+  if (!outfile)
+    outfile = "bf.out";
+
+  if (jobs > 1 && (cache || kind != OUTPUT_EXECUTABLE))
+    errx(EXIT_FAILURE, "--jobs cannot be combined with --cache or --kind");
+
+  if (steps && (interpret || kind != OUTPUT_EXECUTABLE || jobs > 1))
+    errx(EXIT_FAILURE, "--partial-eval only applies to single executables");
+
+  if (progress && (kind != OUTPUT_EXECUTABLE || jobs > 1 || freestanding))
+    errx(EXIT_FAILURE, "--progress cannot be combined with --kind, --jobs or "
+                       "--freestanding");
+
+  if (outline && (kind != OUTPUT_EXECUTABLE || jobs > 1 || steps))
+    errx(EXIT_FAILURE, "--outline cannot be combined with --kind, --jobs or "
+                       "--partial-eval");
+
   char buffer[MAX_FILE_SIZE] = { 0 };
   read_file(argv[optind], buffer);
 
-  gcc_jit_type *return_type = gcc_jit_context_get_type(ctx, GCC_JIT_TYPE_VOID);
-  gcc_jit_type *cell_type = gcc_jit_context_get_type(ctx, GCC_JIT_TYPE_UINT8_T);
-  gcc_jit_type *tape_type = gcc_jit_type_get_pointer(cell_type);
+  if (profile) {
+    if (profile->hash != hash_bytes(FNV_OFFSET, buffer, strlen(buffer))) {
+      warnx("Profile was recorded for a different program, ignoring");
+      destroy_profile(&profile);
+    } else {
+      size_t len = strlen(options);
+      snprintf(options + len, MAX_OPTIONS - len, " -P%016" PRIx64,
+               hash_bytes(FNV_OFFSET, profile->loops,
+                          profile->n * sizeof(loop_profile)));
+    }
+  }
+
+  uint64_t start = monotonic_ns();
+  program_t *ir = parse(buffer);
+  stats.parse = monotonic_ns() - start;
+  stats.ops = ir->n;
+
+  char cached[PATH_MAX];
+  BF_program fn;
+  if (cache) {
+    char key[MAX_OPTIONS + 16];
+    snprintf(key, sizeof(key), "-O%d%s", opt_level, options);
+    cache_path(cache_dir, buffer, ir, key, cached);
+
+    if ((fn = load_cached(cached))) {
+      execute(fn);
+      return 0;
+    }
+  }
+
+  start = monotonic_ns();
+  if (opt_level == AUTO_OPT_LEVEL)
+    opt_level = auto_opt_level(ir);
+
+  gcc_jit_context_set_int_option(ctx, GCC_JIT_INT_OPTION_OPTIMIZATION_LEVEL,
+                                 opt_level);
+
+  if (freestanding)
+    add_freestanding_options(ctx);
+
+  gcc_jit_location **locs =
+      debug ? locate_ops(ctx, ir, buffer, source_path(argv[optind])) : NULL;
+  size_t *loop_ids = outline ? find_duplicate_loops(ir, outline) : NULL;
+
+  prefix *state = NULL;
+  if (steps) {
+    if (!(state = calloc(1, sizeof(prefix))))
+      err(EXIT_FAILURE, NULL);
+
+    partial_eval(ir, state, steps);
+    if (state->pc == 0) {
+      free(state);
+      state = NULL;
+    }
+  }
+
+  stats.optimize = monotonic_ns() - start;
+
+  start = monotonic_ns();
+  size_t bounds[MAX_JOBS + 1];
+  size_t chunks = jobs > 1 ? split_program(ir, jobs, bounds) : 1;
 
-  gcc_jit_param *params[1] = { gcc_jit_context_new_param(ctx, NULL, tape_type,
-                                                         "tape") };
+  char chunk_dir[PATH_MAX];
+  enum gcc_jit_output_kind chunk_kind = GCC_JIT_OUTPUT_KIND_OBJECT_FILE;
+  if (interpret)
+    chunk_kind = GCC_JIT_OUTPUT_KIND_DYNAMIC_LIBRARY;
+  if (chunks > 1) {
+    char *tmpdir = getenv("TMPDIR");
+    snprintf(chunk_dir, sizeof(chunk_dir), "%s/aot-XXXXXX",
+             tmpdir && *tmpdir ? tmpdir : "/tmp");
+    if (!mkdtemp(chunk_dir))
+      err(EXIT_FAILURE, "%s", chunk_dir);
+
+    compile_chunks(ctx, ir, profile, locs, bounds, chunks, chunk_dir,
+                   chunk_kind, jobs);
+
+    if (interpret) {
+      stats.compile = monotonic_ns() - start;
+      execute_chunks(chunk_dir, chunks);
+      remove_chunks(chunk_dir, chunks, chunk_kind);
+      return 0;
+    }
+  }
 
+  bool callbacks = kind != OUTPUT_EXECUTABLE;
   gcc_jit_function *program =
-      gcc_jit_context_new_function(ctx, NULL, GCC_JIT_FUNCTION_EXPORTED,
-                                   return_type, "bf_program", 1, params, 0);
+      declare_program(ctx, callbacks ? symbol : "bf_program", callbacks);
 
-  gen_instructions(ctx, program, buffer);
+  runtime *rt = NULL;
+  if (chunks > 1) {
+    rt = declare_runtime(ctx, GCC_JIT_GLOBAL_EXPORTED);
+    define_runtime(ctx, rt, freestanding);
+    gen_driver(ctx, program, chunks);
 
-  if (interpret) {
+    for (size_t i = 0; i < chunks; i++) {
+      char path[PATH_MAX];
+      chunk_path(chunk_dir, i, chunk_kind, path);
+      gcc_jit_context_add_driver_option(ctx, path);
+    }
+  } else {
+    if (!callbacks) {
+      rt = declare_runtime(ctx, interpret ? GCC_JIT_GLOBAL_IMPORTED
+                                          : GCC_JIT_GLOBAL_INTERNAL);
+      if (!interpret)
+        define_runtime(ctx, rt, freestanding);
+    }
+
+    if (progress) {
+      declare_progress(ctx, rt, interpret ? GCC_JIT_GLOBAL_IMPORTED
+                                           : GCC_JIT_GLOBAL_INTERNAL);
+      if (!interpret)
+        define_progress(ctx, rt);
+    }
+
+    if (state)
+      gen_residual(ctx, program, ir, rt, profile, locs, state);
+    else
+      gen_instructions(ctx, program, ir, rt, profile, locs, loop_ids);
+  }
+
+  if (freestanding)
+    define_start(ctx);
+
+  if (interpret && cache) {
+    store_cached(ctx, cached);
+
+    if (!(fn = load_cached(cached)))
+      errx(EXIT_FAILURE, "%s", dlerror());
+
+    stats.compile = monotonic_ns() - start;
+    execute(fn);
+  } else if (interpret) {
+    PROBE1(compile__start, -1);
     gcc_jit_result *result = gcc_jit_context_compile(ctx);
-    BF_program fn = (BF_program) gcc_jit_result_get_code(result, "bf_program");
+    PROBE1(compile__done, -1);
+    fn = (BF_program) gcc_jit_result_get_code(result, "bf_program");
 
-    uint8_t tape[TAPE_SIZE] = { 0 };
-    fn(tape);
+    stats.compile = monotonic_ns() - start;
+    execute(fn);
 
 #ifdef DEBUG
     gcc_jit_result_release(result);
 #endif
 
+  } else if (kind == OUTPUT_OBJECT) {
+    compile_to_file(ctx, GCC_JIT_OUTPUT_KIND_OBJECT_FILE, outfile);
+  } else if (kind == OUTPUT_LIBRARY) {
+    compile_to_file(ctx, GCC_JIT_OUTPUT_KIND_DYNAMIC_LIBRARY, outfile);
   } else {
-    gcc_jit_type *int_type = gcc_jit_context_get_type(ctx, GCC_JIT_TYPE_INT);
-    gcc_jit_function *main = gcc_jit_context_new_function(
-        ctx, NULL, GCC_JIT_FUNCTION_EXPORTED, int_type, "main", 0, NULL, 0);
-
-    gcc_jit_block *main_block =
-        gcc_jit_function_new_block(main, "program_entry");
+    define_main(ctx, program, rt, state);
+    compile_to_file(ctx, GCC_JIT_OUTPUT_KIND_EXECUTABLE, outfile);
 
-    gcc_jit_lvalue *tape = gcc_jit_function_new_local(
-        main, NULL,
-        gcc_jit_context_new_array_type(ctx, NULL, cell_type, TAPE_SIZE),
-        "tape");
-
-    gcc_jit_lvalue *cell = gcc_jit_context_new_array_access(
-        ctx, NULL, gcc_jit_lvalue_as_rvalue(tape),
-        gcc_jit_context_one(ctx, int_type));
-    gcc_jit_rvalue *ptr = gcc_jit_lvalue_get_address(cell, NULL);
+    if (chunks > 1)
+      remove_chunks(chunk_dir, chunks, chunk_kind);
+  }
 
-    gcc_jit_rvalue *args[1] = { ptr };
-    gcc_jit_rvalue *call =
-        gcc_jit_context_new_call(ctx, NULL, program, 1, args);
-    gcc_jit_block_add_eval(main_block, NULL, call);
-    gcc_jit_block_end_with_return(main_block, NULL,
-                                  gcc_jit_context_zero(ctx, int_type));
+  if (!interpret) {
+    stats.compile = monotonic_ns() - start;
 
-    gcc_jit_context_compile_to_file(ctx, GCC_JIT_OUTPUT_KIND_EXECUTABLE,
-                                    outfile);
+    struct stat st;
+    if (stat(outfile, &st) == 0)
+      stats.code_size = st.st_size;
   }
 
 #ifdef DEBUG
+  if (profile)
+    destroy_profile(&profile);
+
+  free(rt);
+
+  destroy_program(&ir);
   gcc_jit_context_release(ctx);
 #endif
 
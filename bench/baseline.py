@@ -0,0 +1,228 @@
+#!/usr/bin/env python3
+"""Save benchmark baselines and check new runs against them.
+
+Baselines are the JSON written by bench.py (or micro.py with --micro),
+kept in bench/baselines/MACHINE/SUITE/COMMIT.json, where SUITE is
+programs or micro. MACHINE combines the host
+name with a hash of the CPU model, core count and architecture, so
+results from different machines are never compared.
+
+compare runs the suite again and applies a one-sided Mann-Whitney U test
+to the repetitions of each engine/program pair. A pair regresses when
+the test finds it slower at --alpha and its median time grew by more
+than --threshold percent. compare exits with status 1 if any pair
+regressed.
+"""
+
+import argparse
+import glob
+import hashlib
+import json
+import math
+import os
+import re
+import sys
+
+import bench
+import micro
+
+BASELINES = os.path.join(bench.ROOT, "bench", "baselines")
+
+
+def machine_id(meta):
+    cpu = f"{meta['cpu']}|{meta['cpus']}|{meta['machine']}"
+    host = re.sub(r"[^A-Za-z0-9_.-]", "_", meta["host"]) or "unknown"
+    return f"{host}-{hashlib.sha1(cpu.encode()).hexdigest()[:8]}"
+
+
+def run_suite(meta, args):
+    engines = bench.select_engines(args.engines)
+    if not engines:
+        sys.exit("baseline: no engines built")
+
+    if args.micro:
+        kernels = micro.select_kernels(args.names)
+        results = micro.benchmark(engines, kernels, args)
+    else:
+        programs = bench.find_programs(args.names)
+        results = bench.benchmark(engines, programs, args)
+    return {"meta": meta, "suite": "micro" if args.micro else "programs",
+            "results": results}
+
+
+def save(data):
+    path = os.path.join(BASELINES, machine_id(data["meta"]), data["suite"],
+                        data["meta"]["commit"] + ".json")
+    os.makedirs(os.path.dirname(path), exist_ok=True)
+    with open(path, "w") as f:
+        json.dump(data, f, indent=2)
+        f.write("\n")
+    print(f"baseline: saved {os.path.relpath(path)}", file=sys.stderr)
+
+
+def load(path):
+    with open(path) as f:
+        return json.load(f)
+
+
+def saved(machine, suite):
+    found = []
+    for path in glob.glob(os.path.join(BASELINES, machine, suite, "*.json")):
+        data = load(path)
+        found.append((data["meta"]["date"], path, data))
+    return sorted(found)
+
+
+def find_baseline(against, meta, suite):
+    if against and os.path.exists(against):
+        return against, load(against)
+
+    found = saved(machine_id(meta), suite)
+    if against:
+        found = [f for f in found if f[2]["meta"]["commit"] == against]
+        if not found:
+            sys.exit(f"baseline: no {suite} baseline for {against} on "
+                     f"this machine")
+    elif not found:
+        flag = " --micro" if suite == "micro" else ""
+        sys.exit(f"baseline: no {suite} baseline on this machine, run "
+                 f"'{sys.argv[0]} save{flag}' first")
+    return found[-1][1], found[-1][2]
+
+
+def exact_u(m, n):
+    """Number of orderings of m and n values giving each U statistic."""
+    counts = [[None] * (n + 1) for _ in range(m + 1)]
+    for i in range(m + 1):
+        for j in range(n + 1):
+            if i == 0 or j == 0:
+                counts[i][j] = [1]
+                continue
+            # The largest value is either from the first sample, which
+            # then beats all j of the second, or from the second
+            a, b = counts[i - 1][j], counts[i][j - 1]
+            c = [0] * (i * j + 1)
+            for u, k in enumerate(a):
+                c[u + j] += k
+            for u, k in enumerate(b):
+                c[u] += k
+            counts[i][j] = c
+    return counts[m][n]
+
+
+def mann_whitney_greater(x, y):
+    """p-value of the hypothesis that x tends to be greater than y."""
+    m, n = len(x), len(y)
+    u = sum(1.0 if a > b else 0.5 if a == b else 0.0 for a in x for b in y)
+
+    ties = len(set(x + y)) < m + n
+    if not ties and m * n <= 400:
+        dist = exact_u(m, n)
+        return sum(dist[math.ceil(u):]) / sum(dist)
+
+    # Normal approximation with tie and continuity corrections
+    values = sorted(x + y)
+    tied = sum(values.count(v) ** 3 - values.count(v) for v in set(values))
+    total = m + n
+    var = m * n / 12 * (total + 1 - tied / (total * (total - 1)))
+    if var == 0:
+        return 1.0
+    z = (u - m * n / 2 - 0.5) / math.sqrt(var)
+    return 0.5 * math.erfc(z / math.sqrt(2))
+
+
+def key(result):
+    return result["engine"], result.get("program") or result.get("kernel")
+
+
+def compare(base, current, args):
+    baseline = {key(r): r for r in base["results"]}
+    regressions = 0
+    print(f"{'engine':8} {'program':12} {'base':>10} {'now':>10} "
+          f"{'change':>8} {'p':>7}")
+    for r in current["results"]:
+        b = baseline.get(key(r))
+        if b is None:
+            continue
+        if b.get("ops") != r.get("ops"):
+            print(f"baseline: skipping {' '.join(key(r))}, the baseline "
+                  f"ran a different number of ops", file=sys.stderr)
+            continue
+
+        change = (r["median"] / b["median"] - 1) * 100 if b["median"] else 0
+        p = mann_whitney_greater(r["times"], b["times"])
+        regressed = p < args.alpha and change > args.threshold
+        regressions += regressed
+        print(f"{key(r)[0]:8} {key(r)[1]:12} {b['median']:10.4f} "
+              f"{r['median']:10.4f} {change:+7.1f}% {p:7.4f}"
+              + ("  REGRESSED" if regressed else ""))
+    return regressions
+
+
+def parse_args():
+    p = argparse.ArgumentParser(
+        description=__doc__, formatter_class=argparse.RawTextHelpFormatter)
+    sub = p.add_subparsers(dest="command", required=True)
+
+    def suite_args(s):
+        bench.add_run_args(s)
+        s.add_argument("--micro", action="store_true",
+                       help="run the micro.py kernels instead of programs/")
+        s.add_argument("--ops", type=float, default=2e8,
+                       help="commands per kernel with --micro")
+        s.add_argument("names", nargs="*",
+                       help="programs, or kernels with --micro")
+
+    s = sub.add_parser("save", help="run the suite and save a baseline")
+    suite_args(s)
+
+    c = sub.add_parser("compare",
+                       help="run the suite and compare it to a baseline")
+    suite_args(c)
+    c.add_argument("-a", "--against", metavar="COMMIT|FILE",
+                   help="baseline to compare to, default the latest saved")
+    c.add_argument("--alpha", type=float, default=0.05)
+    c.add_argument("-s", "--save", action="store_true",
+                   help="also save the new run as a baseline")
+    c.add_argument("-t", "--threshold", type=float, default=5.0,
+                   help="allowed slowdown of the median in percent")
+
+    sub.add_parser("list", help="list the baselines saved on this machine")
+
+    args = p.parse_args()
+    if args.command != "list":
+        bench.check_run_args(p, args)
+        if args.runs < 2:
+            p.error("--runs must be at least 2 to test for regressions")
+    return args
+
+
+def main():
+    args = parse_args()
+    meta = bench.metadata()
+    if args.command == "list":
+        for suite in ("programs", "micro"):
+            for date, path, data in saved(machine_id(meta), suite):
+                print(f"{date}  {suite:8}  {data['meta']['commit']:16}  "
+                      f"{os.path.relpath(path)}")
+        return
+
+    if args.command == "save":
+        save(run_suite(meta, args))
+        return
+
+    suite = "micro" if args.micro else "programs"
+    path, base = find_baseline(args.against, meta, suite)
+    data = run_suite(meta, args)
+    print(f"baseline: comparing {data['meta']['commit']} against "
+          f"{base['meta']['commit']} ({os.path.relpath(path)})",
+          file=sys.stderr)
+    regressions = compare(base, data, args)
+    if args.save:
+        save(data)
+    if regressions:
+        sys.exit(f"baseline: {regressions} regressed")
+
+
+if __name__ == "__main__":
+    main()
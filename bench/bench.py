@@ -0,0 +1,309 @@
+#!/usr/bin/env python3
+"""Time the programs in programs/ and synthetic ones on every engine.
+
+Synthetic programs are made by gen.py with fixed seeds. Each program
+runs once untimed to check its output against the other engines, then
+--warmup more untimed runs and --runs timed runs. Results go to stdout
+as CSV or JSON, progress to stderr.
+"""
+
+import argparse
+import csv
+import datetime
+import hashlib
+import json
+import os
+import platform
+import resource
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+import gen
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+PROGRAMS = os.path.join(ROOT, "programs")
+
+
+def bin_path(name):
+    return os.path.join(ROOT, name)
+
+
+class Engine:
+    def __init__(self, name, binary, argv, stats=True):
+        self.name = name
+        self.binary = binary
+        self.argv = argv
+        # Whether --stats can report the run time without compilation
+        self.stats = stats
+
+    def available(self):
+        return os.access(bin_path(self.binary), os.X_OK)
+
+    def prepare(self, program, workdir, flags=()):
+        return [bin_path(self.binary)] + self.argv + list(flags) + [program]
+
+
+class Compiled(Engine):
+    """Compiles once with aot and times the resulting executable."""
+
+    def prepare(self, program, workdir, flags=()):
+        name = os.path.splitext(os.path.basename(program))[0]
+        out = os.path.join(workdir, name)
+        cmd = [bin_path(self.binary)] + self.argv + ["-o", out, program]
+        subprocess.run(cmd, check=True, preexec_fn=unlimit_stack)
+        return [out]
+
+
+ENGINES = [
+    Engine("bf", "bf", []),
+    Engine("jit", "jit", []),
+    Engine("aot-e", "aot", ["-e"]),
+    Compiled("aot", "aot", [], stats=False),
+]
+
+
+def unlimit_stack():
+    # bf and jit keep the source buffer on the stack
+    _, hard = resource.getrlimit(resource.RLIMIT_STACK)
+    resource.setrlimit(resource.RLIMIT_STACK, (hard, hard))
+
+
+def lorem(size, seed=1):
+    words = (b"lorem ipsum dolor sit amet consectetur adipiscing elit sed "
+             b"do eiusmod tempor incididunt ut labore et dolore magna "
+             b"aliqua Ut enim ad minim veniam quis nostrud").split()
+    out = bytearray()
+    x = seed
+    while len(out) < size:
+        x = (x * 1103515245 + 12345) & 0x7FFFFFFF
+        out += words[x % len(words)]
+        out += b"\n" if x % 11 == 0 else b" "
+    return bytes(out[:size])
+
+
+# Inputs too large to keep in the tree, generated the same on every run
+GENERATED = {
+    "rot13": lambda: lorem(1 << 19),
+}
+
+
+# Generated with fixed seeds instead of being kept in programs/
+SYNTHETIC = {
+    "synthetic": dict(size=1 << 20, depth=16, footprint=64, trips=4),
+}
+
+
+def find_programs(names):
+    found = [f[:-3] for f in os.listdir(PROGRAMS) if f.endswith(".bf")]
+    found = sorted(found + list(SYNTHETIC))
+    if not names:
+        return found
+
+    for n in names:
+        if n not in found:
+            sys.exit(f"bench: no program {n}.bf in {PROGRAMS}")
+    return names
+
+
+def program_path(name, workdir):
+    if name not in SYNTHETIC:
+        return os.path.join(PROGRAMS, name + ".bf")
+
+    path = os.path.join(workdir, name + ".bf")
+    with open(path, "w") as f:
+        f.write(gen.generate(**SYNTHETIC[name]))
+    return path
+
+
+def input_for(name, workdir):
+    path = os.path.join(PROGRAMS, name + ".in")
+    if os.path.exists(path):
+        return path
+
+    if name in GENERATED:
+        path = os.path.join(workdir, name + ".in")
+        with open(path, "wb") as f:
+            f.write(GENERATED[name]())
+        return path
+
+    return os.devnull
+
+
+def run(cmd, stdin, capture=False, stderr=False):
+    """Returns the wall time, and stdout and stderr if asked to capture."""
+    with open(stdin, "rb") as f:
+        start = time.perf_counter()
+        p = subprocess.run(cmd, stdin=f, preexec_fn=unlimit_stack,
+                           stdout=subprocess.PIPE if capture else
+                           subprocess.DEVNULL,
+                           stderr=subprocess.PIPE if stderr else None)
+        elapsed = time.perf_counter() - start
+
+    if p.returncode != 0:
+        sys.exit(f"bench: {' '.join(cmd)} exited with {p.returncode}")
+    return elapsed, p.stdout, p.stderr
+
+
+def summarize(times):
+    return {
+        "runs": len(times),
+        "mean": statistics.mean(times),
+        "median": statistics.median(times),
+        "stddev": statistics.stdev(times) if len(times) > 1 else 0.0,
+        "min": min(times),
+        "max": max(times),
+    }
+
+
+def command_output(cmd):
+    try:
+        return subprocess.run(cmd, capture_output=True, text=True,
+                              cwd=ROOT).stdout.strip()
+    except OSError:
+        return ""
+
+
+def cpu_model():
+    try:
+        with open("/proc/cpuinfo") as f:
+            for line in f:
+                if line.startswith("model name"):
+                    return line.split(":", 1)[1].strip()
+    except OSError:
+        pass
+    return platform.processor()
+
+
+def metadata():
+    commit = command_output(["git", "rev-parse", "--short", "HEAD"])
+    if command_output(["git", "status", "--porcelain", "-uno"]):
+        commit += "-dirty"
+
+    cc = os.environ.get("CC", "cc")
+    return {
+        "commit": commit,
+        "date": datetime.datetime.now(datetime.timezone.utc)
+                .isoformat(timespec="seconds"),
+        "host": platform.node(),
+        "machine": platform.machine(),
+        "cpu": cpu_model(),
+        "cpus": os.cpu_count(),
+        "kernel": f"{platform.system()} {platform.release()}",
+        "compiler": command_output([cc, "--version"]).split("\n")[0],
+        "cflags": os.environ.get("CFLAGS", ""),
+    }
+
+
+def benchmark(engines, programs, args):
+    results = []
+    with tempfile.TemporaryDirectory(prefix="bench") as workdir:
+        for name in programs:
+            program = program_path(name, workdir)
+            stdin = input_for(name, workdir)
+            expected = None
+
+            for engine in engines:
+                print(f"{engine.name} {name}", file=sys.stderr)
+                cmd = engine.prepare(program, workdir)
+
+                _, out, _ = run(cmd, stdin, capture=True)
+                digest = hashlib.sha256(out).hexdigest()
+                if expected is None:
+                    expected = (engine.name, digest)
+                elif digest != expected[1]:
+                    sys.exit(f"bench: {engine.name} and {expected[0]} "
+                             f"disagree on the output of {name}")
+
+                for _ in range(args.warmup):
+                    run(cmd, stdin)
+                times = [run(cmd, stdin)[0] for _ in range(args.runs)]
+
+                results.append({"engine": engine.name, "program": name,
+                                **summarize(times), "times": times})
+    return results
+
+
+FIELDS = ["engine", "program", "runs", "mean", "median", "stddev", "min",
+          "max"]
+
+
+def write_csv(meta, results, out, fields=FIELDS):
+    w = csv.writer(out)
+    w.writerow(fields + list(meta))
+    for r in results:
+        w.writerow([r[f] for f in fields] + list(meta.values()))
+
+
+def write_json(meta, results, out):
+    json.dump({"meta": meta, "results": results}, out, indent=2)
+    out.write("\n")
+
+
+def add_run_args(p):
+    p.add_argument("-e", "--engines",
+                   help="comma separated subset of "
+                   + ",".join(e.name for e in ENGINES))
+    p.add_argument("-n", "--runs", type=int, default=5)
+    p.add_argument("-w", "--warmup", type=int, default=1)
+
+
+def check_run_args(p, args):
+    if args.runs < 1 or args.warmup < 0:
+        p.error("--runs must be positive and --warmup not negative")
+
+
+def parse_args():
+    p = argparse.ArgumentParser(description=__doc__)
+    add_run_args(p)
+    p.add_argument("-f", "--format", choices=["csv", "json"], default="csv")
+    p.add_argument("-o", "--output", help="write results to FILE")
+    p.add_argument("programs", nargs="*",
+                   help="names of programs in programs/ or synthetic "
+                   "ones, default all")
+    args = p.parse_args()
+    check_run_args(p, args)
+    return args
+
+
+def select_engines(names):
+    if not names:
+        engines = [e for e in ENGINES if e.available()]
+        for e in ENGINES:
+            if not e.available():
+                print(f"bench: skipping {e.name}, ./{e.binary} is not built",
+                      file=sys.stderr)
+        return engines
+
+    by_name = {e.name: e for e in ENGINES}
+    engines = []
+    for n in names.split(","):
+        if n not in by_name:
+            sys.exit(f"bench: unknown engine {n}")
+        if not by_name[n].available():
+            sys.exit(f"bench: ./{by_name[n].binary} is not built")
+        engines.append(by_name[n])
+    return engines
+
+
+def main():
+    args = parse_args()
+    engines = select_engines(args.engines)
+    if not engines:
+        sys.exit("bench: no engines built")
+
+    meta = metadata()
+    results = benchmark(engines, find_programs(args.programs), args)
+
+    write = write_json if args.format == "json" else write_csv
+    if args.output:
+        with open(args.output, "w", newline="") as f:
+            write(meta, results, f)
+    else:
+        write(meta, results, sys.stdout)
+
+
+if __name__ == "__main__":
+    main()
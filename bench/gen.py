@@ -0,0 +1,240 @@
+#!/usr/bin/env python3
+"""Generate valid brainfuck with controlled characteristics.
+
+Programs are built from units of loops nested --depth deep. Every loop
+counts down a cell of its own from a small trip count, and loop bodies
+draw snippets from the --mix categories:
+
+  arith  runs of +/-, [-] and multiply loops
+  copy   copy loops from one cell to another
+  scan   [>] and [<] over a run of nonzero cells set up just before
+  io     . and ,
+
+Snippets only touch the --footprint cells after the loop counters, and
+the pointer always returns to the counter before a loop closes, so the
+programs terminate. Depth is not limited by STACK_SIZE; engines are
+expected to reject programs nested deeper than they support. --comments
+mixes that fraction of non-command text into the output. The same
+arguments and --seed always give the same program.
+"""
+
+import argparse
+import random
+import sys
+
+WORDS = ("lorem ipsum dolor sit amet consectetur adipiscing elit sed do "
+         "eiusmod tempor incididunt ut labore et dolore magna aliqua").split()
+
+CATEGORIES = ["arith", "copy", "scan", "io"]
+
+# Loops deeper than this product of trip counts run only once
+MAX_TRIPS = 1 << 12
+
+
+class Generator:
+    def __init__(self, depth, footprint, mix, comments, trips, rng):
+        self.depth = depth
+        self.base = depth
+        self.footprint = footprint
+        self.mix = mix
+        self.comments = comments
+        self.trips = trips
+        self.rng = rng
+        self.out = []
+        self.code = 0
+        self.text = 0
+        self.ptr = 0
+
+    def emit(self, s):
+        self.out.append(s)
+        self.code += len(s)
+        if self.comments and self.text < self.comments * (self.code +
+                                                          self.text):
+            word = self.rng.choice(WORDS) + self.rng.choice(" \n")
+            self.out.append(word)
+            self.text += len(word)
+
+    def go(self, cell):
+        d = cell - self.ptr
+        self.ptr = cell
+        if d:
+            self.emit(">" * d if d > 0 else "<" * -d)
+
+    def cell(self):
+        return self.base + self.rng.randrange(self.footprint)
+
+    def arith(self):
+        kind = self.rng.randrange(3)
+        if kind == 2:
+            return self.multiply(self.rng.randint(2, 5))
+
+        self.go(self.cell())
+        if kind == 0:
+            self.emit(self.rng.choice("+-") * self.rng.randint(1, 16))
+        else:
+            self.emit("[-]")
+
+    def copy(self):
+        self.multiply(1)
+
+    def multiply(self, factor):
+        src = self.cell()
+        self.go(src)
+        if self.footprint < 2:
+            return self.emit("[-]")
+
+        dst = self.cell()
+        while dst == src:
+            dst = self.cell()
+        self.emit("[-")
+        self.go(dst)
+        self.emit("+" * factor)
+        self.go(src)
+        self.emit("]")
+
+    def scan(self):
+        if self.footprint < 3:
+            return self.arith()
+
+        # A run of nonzero cells between two zero cells, so that the scan
+        # ends at a known cell whichever way it goes
+        length = self.rng.randint(1, self.footprint - 2)
+        first = self.base + 1 + self.rng.randrange(self.footprint - 1 - length)
+        self.go(first - 1)
+        self.emit("[-]")
+        for c in range(first, first + length):
+            self.go(c)
+            self.emit("[-]+")
+        self.go(first + length)
+        self.emit("[-]")
+        if self.rng.randrange(2):
+            self.go(first)
+            self.emit("[>]")
+            self.ptr = first + length
+        else:
+            self.go(first + length - 1)
+            self.emit("[<]")
+            self.ptr = first - 1
+
+    def io(self):
+        self.go(self.cell())
+        self.emit(self.rng.choice(".,"))
+
+    def snippet(self):
+        kind = self.rng.choices(CATEGORIES, weights=self.mix)[0]
+        getattr(self, kind)()
+
+    def body(self):
+        for _ in range(self.rng.randint(0, 2)):
+            self.snippet()
+
+    def unit(self):
+        # The product of trip counts so far, per open loop
+        product = 1
+        for level in range(self.depth):
+            self.body()
+            trips = self.rng.randint(1, self.trips)
+            if product * trips > MAX_TRIPS:
+                trips = 1
+            product *= trips
+            self.go(level)
+            self.emit("[-]" + "+" * trips + "[")
+        for level in reversed(range(self.depth)):
+            self.body()
+            self.go(level)
+            self.emit("-]")
+        if not self.depth:
+            self.body()
+
+
+def generate(size, depth=8, footprint=16, mix=(1, 1, 1, 1), comments=0.0,
+             trips=2, seed=1, dormant=False):
+    """A program of about size bytes, or one unit if that is larger.
+
+    With dormant, the program prints a byte and reads one before
+    anything else, and everything after that sits in a loop that never
+    runs: it is parsed and compiled, but not executed.
+    """
+    rng = random.Random(seed)
+    g = Generator(depth, footprint, mix, comments, trips, rng)
+    prefix = "+" * 33 + ".,[-][" if dormant else ""
+    if dormant:
+        g.out.append(prefix)
+        g.code += len(prefix)
+
+    units = 0
+    while g.code + g.text < size:
+        saved = len(g.out), g.code, g.text, g.ptr
+        g.unit()
+        units += 1
+        if g.code + g.text > size and units > 1:
+            # Replace the unit that overshot with straight-line filler,
+            # but keep the first so that the program reaches full depth
+            del g.out[saved[0]:]
+            g.code, g.text, g.ptr = saved[1:]
+            fill = size - g.code - g.text
+            g.out.append("".join(rng.choice("+-") for _ in range(fill)))
+            g.code += fill
+
+    if dormant:
+        g.out.append("]")
+    g.out.append("\n")
+    return "".join(g.out)
+
+
+def parse_mix(spec):
+    weights = dict.fromkeys(CATEGORIES, 0)
+    for item in spec.split(","):
+        name, _, weight = item.partition("=")
+        if name not in weights:
+            raise argparse.ArgumentTypeError(f"unknown category {name}")
+        try:
+            weights[name] = float(weight) if weight else 1.0
+        except ValueError:
+            raise argparse.ArgumentTypeError(f"bad weight {weight}")
+    if not any(weights.values()):
+        raise argparse.ArgumentTypeError("all weights are zero")
+    return tuple(weights[c] for c in CATEGORIES)
+
+
+def parse_args():
+    p = argparse.ArgumentParser(
+        description=__doc__, formatter_class=argparse.RawTextHelpFormatter)
+    p.add_argument("-c", "--comments", type=float, default=0.0,
+                   help="fraction of the output that is comment text")
+    p.add_argument("-d", "--depth", type=int, default=8,
+                   help="loop nesting depth of every unit, default 8")
+    p.add_argument("--dormant", action="store_true",
+                   help="print and read a byte, then skip everything else")
+    p.add_argument("-f", "--footprint", type=int, default=16,
+                   help="work cells besides the loop counters, default 16")
+    p.add_argument("-m", "--mix", type=parse_mix, default=(1, 1, 1, 1),
+                   help="weights like arith=2,copy,scan=0.5,io=0")
+    p.add_argument("-o", "--output", help="write to FILE")
+    p.add_argument("-s", "--size", type=int, default=1 << 16,
+                   help="approximate size in bytes, default 65536")
+    p.add_argument("--seed", type=int, default=1)
+    p.add_argument("-t", "--trips", type=int, default=2,
+                   help="most iterations of each loop, default 2")
+    args = p.parse_args()
+    if args.depth < 0 or args.footprint < 1 or args.size < 1:
+        p.error("--depth must not be negative, --footprint and --size "
+                "must be positive")
+    if not 0 <= args.comments < 1 or args.trips < 1:
+        p.error("--comments must be within [0, 1) and --trips positive")
+    return args
+
+
+def main():
+    args = parse_args()
+    program = generate(args.size, args.depth, args.footprint, args.mix,
+                       args.comments, args.trips, args.seed, args.dormant)
+    if args.output:
+        with open(args.output, "w") as f:
+            f.write(program)
+    else:
+        sys.stdout.write(program)
+
+
+if __name__ == "__main__":
+    main()
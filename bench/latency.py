@@ -0,0 +1,295 @@
+#!/usr/bin/env python3
+"""Measure how parse and compile latency scale with program size.
+
+Generates programs with gen.py of growing size at a fixed loop depth
+(the size sweep) and of growing loop depth at a fixed size (the depth
+sweep).
+For each, every engine reports its parse, IR optimization and compile
+time through --stats. First-output latency is the time from starting
+the process to the first byte of output. The generated programs print
+one byte and read from stdin before anything else, which flushes the
+buffered output, and the rest of the program sits in a loop that never
+runs, so that every op is compiled but nothing executes. For aot the
+time to write an executable is measured instead.
+
+The size sweep fits the exponent k of time ~ size^k per engine and
+phase over its four largest programs; k well above 1 means a phase
+scales superlinearly. Results go to stdout as CSV or JSON, and --plot
+writes an SVG of the curves.
+"""
+
+import argparse
+import json
+import math
+import os
+import select
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+import bench
+import gen
+
+# bf, jit and aot refuse sources of MAX_FILE_SIZE (8 MiB) and more
+MAX_SIZE = 8 * 1024 * 1024 - 64 * 1024
+SIZES = [1 << 10, 1 << 12, 1 << 14, 1 << 16, 1 << 18, 1 << 20, 1 << 22,
+         MAX_SIZE]
+# Within STACK_SIZE (256) including the loop that skips the body and a
+# loop snippet in the innermost one
+DEPTHS = [1, 4, 16, 64, 128, 254]
+
+def latency(cmd, timeout):
+    """Stats of one run, plus the first-output latency in ns."""
+    start = time.perf_counter_ns()
+    p = subprocess.Popen(cmd, stdin=subprocess.PIPE, stdout=subprocess.PIPE,
+                         stderr=subprocess.PIPE,
+                         preexec_fn=bench.unlimit_stack)
+    try:
+        if not select.select([p.stdout], [], [], timeout)[0]:
+            raise subprocess.TimeoutExpired(cmd, timeout)
+        first = None
+        if p.stdout.read(1):
+            first = time.perf_counter_ns() - start
+        _, err = p.communicate(b"", timeout=timeout)
+    except subprocess.TimeoutExpired:
+        p.kill()
+        p.communicate()
+        return None
+
+    if p.returncode != 0:
+        sys.exit(f"latency: {' '.join(cmd)} exited with {p.returncode}:\n"
+                 + err.decode())
+    stats = json.loads(err.decode().strip().split("\n")[-1])
+    stats["first_output_ns"] = first
+    stats["wall_ns"] = time.perf_counter_ns() - start
+    return stats
+
+
+def command(engine, path, workdir):
+    if isinstance(engine, bench.Compiled):
+        out = os.path.join(workdir, "a.out")
+        return [bench.bin_path(engine.binary), "--stats=json", "-o", out,
+                path]
+    return engine.prepare(path, workdir, ["--stats=json"])
+
+
+PHASES = ["parse_ns", "optimize_ns", "compile_ns", "first_output_ns",
+          "wall_ns"]
+
+
+def median(runs, phase):
+    values = [r[phase] for r in runs if r.get(phase) is not None]
+    return statistics.median(values) if values else None
+
+
+def sweep(name, points, engines, args, workdir):
+    results = []
+    timed_out = set()
+    for size, depth in points:
+        path = os.path.join(workdir, f"{name}-{size}-{depth}.bf")
+        with open(path, "w") as f:
+            f.write(gen.generate(size, depth, args.footprint, args.mix,
+                                 args.comments, seed=args.seed,
+                                 dormant=True))
+
+        for engine in engines:
+            if engine.name in timed_out:
+                continue
+            print(f"{engine.name} {name} size {size} depth {depth}",
+                  file=sys.stderr)
+
+            cmd = command(engine, path, workdir)
+            for _ in range(args.warmup):
+                latency(cmd, args.timeout)
+            runs = []
+            for _ in range(args.runs):
+                r = latency(cmd, args.timeout)
+                if r is None:
+                    print(f"latency: {engine.name} timed out, dropping it "
+                          f"from the {name} sweep", file=sys.stderr)
+                    timed_out.add(engine.name)
+                    break
+                runs.append(r)
+            if not runs:
+                continue
+
+            results.append({"engine": engine.name, "sweep": name,
+                            "size": size, "depth": depth,
+                            "ops": runs[0].get("ops"),
+                            "runs": len(runs),
+                            **{p: median(runs, p) for p in PHASES}})
+    return results
+
+
+def exponent(points):
+    """Least squares slope of log(time) over log(size)."""
+    points = [(math.log(x), math.log(y)) for x, y in points if y]
+    if len(points) < 2:
+        return None
+
+    mx = statistics.mean(x for x, _ in points)
+    my = statistics.mean(y for _, y in points)
+    sxx = sum((x - mx) ** 2 for x, _ in points)
+    return sum((x - mx) * (y - my) for x, y in points) / sxx
+
+
+def exponents(results, points=4):
+    """Fits over the largest sizes only, where fixed startup costs do not
+    flatten the curve."""
+    fits = []
+    for engine in sorted({r["engine"] for r in results}):
+        rows = [r for r in results
+                if r["engine"] == engine and r["sweep"] == "size"]
+        rows = sorted(rows, key=lambda r: r["size"])[-points:]
+        for phase in PHASES:
+            k = exponent([(r["size"], r[phase]) for r in rows])
+            if k is not None:
+                fits.append({"engine": engine, "phase": phase,
+                             "exponent": k})
+    return fits
+
+
+def short(n):
+    for unit, scale in (("M", 1 << 20), ("K", 1 << 10)):
+        if n >= scale:
+            return f"{n / scale:.3g}{unit}"
+    return str(n)
+
+
+COLORS = ["#1f77b4", "#d62728", "#2ca02c", "#9467bd", "#ff7f0e"]
+
+
+def plot(results, path):
+    """Log-log SVG of first-output latency (or wall time for aot) and
+    compile time against the swept parameter."""
+    panels = [("size", "size", "bytes"), ("depth", "depth", "loop depth")]
+    width, height, margin = 480, 320, 60
+    svg = [f'<svg xmlns="http://www.w3.org/2000/svg" '
+           f'width="{width * len(panels)}" height="{height}" '
+           f'font-family="sans-serif" font-size="11">']
+
+    for i, (sweep, xkey, xlabel) in enumerate(panels):
+        rows = [r for r in results if r["sweep"] == sweep]
+        series = []
+        for j, engine in enumerate(sorted({r["engine"] for r in rows})):
+            mine = [r for r in rows if r["engine"] == engine]
+            total = "wall_ns" if engine == "aot" else "first_output_ns"
+            for phase, dash in ((total, ""), ("compile_ns", "4,3")):
+                pts = [(r[xkey], r[phase] / 1e9) for r in mine
+                       if r[phase] and r[xkey] > 0]
+                if pts:
+                    series.append((f"{engine} {phase[:-3]}", dash,
+                                   COLORS[j % len(COLORS)], pts))
+        if not series:
+            continue
+
+        xs = [x for s in series for x, _ in s[3]]
+        ys = [y for s in series for _, y in s[3]]
+        x0, x1 = math.log10(min(xs)), math.log10(max(xs)) + 1e-9
+        y0, y1 = math.log10(min(ys)), math.log10(max(ys)) + 1e-9
+        left = i * width + margin
+        w, h = width - 2 * margin, height - 2 * margin
+
+        def sx(x):
+            return left + (math.log10(x) - x0) / (x1 - x0) * w
+
+        def sy(y):
+            return margin + h - (math.log10(y) - y0) / (y1 - y0) * h
+
+        svg.append(f'<rect x="{left}" y="{margin}" width="{w}" '
+                   f'height="{h}" fill="none" stroke="#888"/>')
+        svg.append(f'<text x="{left + w / 2}" y="{height - 20}" '
+                   f'text-anchor="middle">{xlabel}</text>')
+        svg.append(f'<text x="{left}" y="{margin - 8}">seconds, log-log, '
+                   f'{sweep} sweep</text>')
+        for x in sorted(set(xs)):
+            svg.append(f'<text x="{sx(x):.1f}" y="{margin + h + 14}" '
+                       f'text-anchor="middle">{short(x)}</text>')
+        for y in (min(ys), max(ys)):
+            svg.append(f'<text x="{left - 4}" y="{sy(y) + 4:.1f}" '
+                       f'text-anchor="end">{y:.3g}</text>')
+        for k, (label, dash, color, pts) in enumerate(series):
+            line = " ".join(f"{sx(x):.1f},{sy(y):.1f}" for x, y in pts)
+            svg.append(f'<polyline points="{line}" fill="none" '
+                       f'stroke="{color}" stroke-dasharray="{dash}"/>')
+            svg.append(f'<text x="{left + 6}" y="{margin + 14 + 13 * k}" '
+                       f'fill="{color}">{label}</text>')
+
+    svg.append("</svg>")
+    with open(path, "w") as f:
+        f.write("\n".join(svg) + "\n")
+
+
+FIELDS = ["engine", "sweep", "size", "depth", "ops", "runs"] + PHASES
+
+
+def parse_args():
+    p = argparse.ArgumentParser(
+        description=__doc__, formatter_class=argparse.RawTextHelpFormatter)
+    bench.add_run_args(p)
+    p.add_argument("--comments", type=float, default=0.0,
+                   help="fraction of comment text, see gen.py")
+    p.add_argument("-d", "--depth", type=int, default=8,
+                   help="loop depth of the size sweep")
+    p.add_argument("-f", "--format", choices=["csv", "json"], default="csv")
+    p.add_argument("--footprint", type=int, default=16,
+                   help="work cells, see gen.py")
+    p.add_argument("--mix", type=gen.parse_mix, default=(1, 1, 1, 1),
+                   help="snippet weights, see gen.py")
+    p.add_argument("-m", "--max-size", type=int, default=MAX_SIZE,
+                   help="largest program of the size sweep")
+    p.add_argument("-o", "--output", help="write results to FILE")
+    p.add_argument("-p", "--plot", metavar="SVG", help="plot to SVG")
+    p.add_argument("-s", "--size", type=int, default=1 << 16,
+                   help="program size of the depth sweep")
+    p.add_argument("--seed", type=int, default=1)
+    p.add_argument("-t", "--timeout", type=float, default=600,
+                   help="seconds before an engine is dropped from a sweep")
+    p.set_defaults(runs=3, warmup=0)
+    args = p.parse_args()
+    bench.check_run_args(p, args)
+    if not 0 < args.depth <= max(DEPTHS):
+        p.error(f"--depth must be within 1-{max(DEPTHS)}")
+    if args.footprint < 1 or not 0 <= args.comments < 1:
+        p.error("--footprint must be positive and --comments within [0, 1)")
+    if not 0 < args.max_size <= MAX_SIZE:
+        p.error(f"--max-size must be within 1-{MAX_SIZE}")
+    return args
+
+
+def main():
+    args = parse_args()
+    engines = bench.select_engines(args.engines)
+    if not engines:
+        sys.exit("latency: no engines built")
+
+    sizes = [s for s in SIZES if s < args.max_size] + [args.max_size]
+    meta = bench.metadata()
+    with tempfile.TemporaryDirectory(prefix="latency") as workdir:
+        results = sweep("size", [(s, args.depth) for s in sizes], engines,
+                        args, workdir)
+        results += sweep("depth", [(args.size, d) for d in DEPTHS], engines,
+                         args, workdir)
+
+    fits = exponents(results)
+    for f in fits:
+        print(f"latency: {f['engine']} {f['phase']} ~ size^"
+              f"{f['exponent']:.2f}", file=sys.stderr)
+    if args.plot:
+        plot(results, args.plot)
+
+    out = open(args.output, "w", newline="") if args.output else sys.stdout
+    if args.format == "json":
+        json.dump({"meta": meta, "results": results, "exponents": fits},
+                  out, indent=2)
+        out.write("\n")
+    else:
+        bench.write_csv(meta, results, out, FIELDS)
+    if args.output:
+        out.close()
+
+
+if __name__ == "__main__":
+    main()
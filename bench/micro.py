@@ -0,0 +1,258 @@
+#!/usr/bin/env python3
+"""Time synthetic kernels that each isolate one brainfuck idiom.
+
+Every kernel repeats a small body inside counter loops. ops is the
+number of brainfuck commands the body executes, not counting the loops
+around it, and ops_per_sec divides that by the time spent running.
+Engines that support --stats report the run time without parsing and
+compilation; for aot-built executables the time of an empty executable
+is subtracted instead.
+"""
+
+import argparse
+import hashlib
+import json
+import math
+import os
+import statistics
+import sys
+import tempfile
+
+import bench
+
+
+class Kernel:
+    def __init__(self, name, body, setup="", pad=0, reads=0):
+        self.name = name
+        self.body = body
+        # Run once before the loops, from and back to the kernel's cell
+        self.setup = setup
+        # Zero cells left of the kernel's first cell
+        self.pad = pad
+        # Input bytes consumed per iteration
+        self.reads = reads
+
+
+def scan(stride, marks=64):
+    step = ">" * stride
+    back = "<" * stride
+    return Kernel(f"scan{stride}",
+                  f"[{step}]{back}[{back}]{step}",
+                  setup=("+" + step) * marks + "<" * (stride * marks),
+                  pad=stride)
+
+
+KERNELS = [
+    Kernel("add", "+" * 97 + ">" + "-" * 89 + "<"),
+    Kernel("clear", "+" * 32 + "[-]"),
+    scan(1),
+    scan(4),
+    scan(16),
+    Kernel("copy", "[->+<]>[-<+>]<", setup="+" * 50),
+    # 3 * 171 = 1 (mod 256), so the cell is back to 5 after each iteration
+    Kernel("multiply", "[->+++<]>[-<" + "+" * 171 + ">]<", setup="+" * 5),
+    Kernel("nest", "+[>" * 64 + "<-]" * 64),
+    Kernel("put", "+" * 100 + "[.-]"),
+    Kernel("get", ">" + "+" * 64 + "[<,>-]<", reads=64),
+]
+
+
+def count(kernel):
+    """Commands executed by one iteration of the body once it is steady."""
+    code = kernel.setup + kernel.body * 3
+    match, stack = {}, []
+    for i, c in enumerate(code):
+        if c == "[":
+            stack.append(i)
+        elif c == "]":
+            j = stack.pop()
+            match[i], match[j] = j, i
+
+    tape = [0] * 4096
+    ptr = kernel.pad
+    pc = 0
+    executed = 0
+    marks = []
+    ends = {len(kernel.setup) + len(kernel.body) * k for k in range(4)}
+    while pc <= len(code):
+        if pc in ends:
+            marks.append((executed, ptr, list(tape)))
+        if pc == len(code):
+            break
+
+        c = code[pc]
+        executed += 1
+        if c == "+":
+            tape[ptr] = (tape[ptr] + 1) % 256
+        elif c == "-":
+            tape[ptr] = (tape[ptr] - 1) % 256
+        elif c == ">":
+            ptr += 1
+        elif c == "<":
+            ptr -= 1
+        elif c == ",":
+            tape[ptr] = ord("x")
+        elif c == "[" and tape[ptr] == 0:
+            pc = match[pc]
+        elif c == "]" and tape[ptr] != 0:
+            pc = match[pc]
+        pc += 1
+
+    # Loop trip counts depend on the tape, straight-line bodies only on the
+    # pointer coming back
+    per = [b[0] - a[0] for a, b in zip(marks, marks[1:])]
+    steady = marks[2][1:] == marks[3][1:] or "[" not in kernel.body
+    if marks[0][1] != marks[3][1] or not steady or per[1] != per[2]:
+        sys.exit(f"micro: kernel {kernel.name} does not reach a steady state")
+    return per[2]
+
+
+def program(kernel, iterations):
+    """Nests counter loops of at most 255 trips around the body."""
+    levels = max(1, math.ceil(math.log(iterations, 255)))
+    trips = math.ceil(iterations ** (1 / levels))
+
+    # Cell 0 stays zero, then come the counters and then the kernel
+    to_kernel = ">" * (1 + levels + kernel.pad)
+    code = to_kernel + kernel.setup + "<" * (levels + kernel.pad)
+    for i in range(levels):
+        code += "+" * trips + "["
+        code += ">" if i + 1 < levels else ">" * (1 + kernel.pad)
+    code += kernel.body
+    if "[" not in kernel.body:
+        # Otherwise the innermost counter loop folds into a multiplication
+        back = "<" * (1 + levels + kernel.pad)
+        code += back + "[]" + ">" * len(back)
+    for i in reversed(range(levels)):
+        code += "<" if i + 1 < levels else "<" * (1 + kernel.pad)
+        code += "-]"
+    return code, trips ** levels
+
+
+def run_ns(stderr):
+    return json.loads(stderr.decode().strip().split("\n")[-1])["run_ns"]
+
+
+def measure(engine, path, stdin, workdir, args, empty):
+    flags = ["--stats=json"] if engine.stats else []
+    cmd = engine.prepare(path, workdir, flags)
+
+    _, out, _ = bench.run(cmd, stdin, capture=True, stderr=engine.stats)
+    for _ in range(args.warmup):
+        bench.run(cmd, stdin, stderr=engine.stats)
+
+    times = []
+    for _ in range(args.runs):
+        elapsed, _, err = bench.run(cmd, stdin, stderr=engine.stats)
+        if engine.stats:
+            times.append(run_ns(err) / 1e9)
+        else:
+            times.append(max(elapsed - empty, 0.0))
+    return times, hashlib.sha256(out).hexdigest()
+
+
+def empty_time(engine, workdir, args):
+    path = os.path.join(workdir, "empty.bf")
+    with open(path, "w") as f:
+        f.write("\n")
+    cmd = engine.prepare(path, workdir)
+    return statistics.median(bench.run(cmd, os.devnull)[0]
+                             for _ in range(args.runs))
+
+
+def benchmark(engines, kernels, args):
+    results = []
+    with tempfile.TemporaryDirectory(prefix="micro") as workdir:
+        empty = {e.name: 0.0 if e.stats else empty_time(e, workdir, args)
+                 for e in engines}
+
+        for kernel in kernels:
+            per = count(kernel)
+            code, iterations = program(kernel, max(1, int(args.ops / per)))
+            path = os.path.join(workdir, kernel.name + ".bf")
+            with open(path, "w") as f:
+                f.write(code)
+
+            stdin = os.devnull
+            if kernel.reads:
+                stdin = os.path.join(workdir, kernel.name + ".in")
+                with open(stdin, "wb") as f:
+                    f.write(b"x" * (kernel.reads * iterations))
+
+            expected = None
+            for engine in engines:
+                print(f"{engine.name} {kernel.name}", file=sys.stderr)
+                times, digest = measure(engine, path, stdin, workdir, args,
+                                        empty[engine.name])
+                if expected is None:
+                    expected = (engine.name, digest)
+                elif digest != expected[1]:
+                    sys.exit(f"micro: {engine.name} and {expected[0]} "
+                             f"disagree on the output of {kernel.name}")
+
+                s = bench.summarize(times)
+                ops = per * iterations
+                results.append({"engine": engine.name, "kernel": kernel.name,
+                                "ops": ops, **s,
+                                "ops_per_sec": ops / s["median"]
+                                if s["median"] else None,
+                                "times": times})
+    return results
+
+
+FIELDS = ["engine", "kernel", "ops", "runs", "median", "stddev", "min",
+          "max", "ops_per_sec"]
+
+
+def parse_args():
+    p = argparse.ArgumentParser(description=__doc__)
+    bench.add_run_args(p)
+    p.add_argument("-f", "--format", choices=["csv", "json"], default="csv")
+    p.add_argument("-o", "--output", help="write results to FILE")
+    p.add_argument("--ops", type=float, default=2e8,
+                   help="commands each kernel executes, default %(default)g")
+    p.add_argument("kernels", nargs="*",
+                   help="any of " + ",".join(k.name for k in KERNELS))
+    args = p.parse_args()
+    bench.check_run_args(p, args)
+    if args.ops < 1:
+        p.error("--ops must be positive")
+    return args
+
+
+def select_kernels(names):
+    if not names:
+        return KERNELS
+
+    by_name = {k.name: k for k in KERNELS}
+    for n in names:
+        if n not in by_name:
+            sys.exit(f"micro: unknown kernel {n}")
+    return [by_name[n] for n in names]
+
+
+def write(format, meta, results, out):
+    if format == "json":
+        bench.write_json(meta, results, out)
+    else:
+        bench.write_csv(meta, results, out, FIELDS)
+
+
+def main():
+    args = parse_args()
+    engines = bench.select_engines(args.engines)
+    if not engines:
+        sys.exit("micro: no engines built")
+
+    meta = bench.metadata()
+    results = benchmark(engines, select_kernels(args.kernels), args)
+
+    if args.output:
+        with open(args.output, "w", newline="") as f:
+            write(args.format, meta, results, f)
+    else:
+        write(args.format, meta, results, sys.stdout)
+
+
+if __name__ == "__main__":
+    main()
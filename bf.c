@@ -24,19 +24,25 @@
 #include <err.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <libgen.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+#include "ir.h"
+#include "probes.h"
+#include "rt.h"
+#include "stats.h"
+
 #define READ_SIZE 1024 * 8
 #define MAX_FILE_SIZE 1024 * 1024 * 8
 #define TAPE_SIZE 30000
-#define STACK_SIZE 256
-#define PROGRAM_SIZE 4096
+#define MAX_DELTA TAPE_SIZE
 
 #ifdef _BF_STRICT_CHECKS
 #define BOUNDS_CHECK(i)                                                        \
@@ -54,30 +60,21 @@
 #define UNDERFLOW_CHECK(arr, pos, x)
 #endif
 
-#define IS_EMPTY_STACK(stack) (stack.len == 0)
-#define POP_STACK(stack) stack.data[--stack.len]
-#define PUSH_STACK(stack, x)                                                   \
-  do {                                                                         \
-    if (stack.len == STACK_SIZE)                                               \
-      errx(EXIT_FAILURE, "Nested loops exceeded stack size");                  \
-    stack.data[stack.len++] = x;                                               \
-  } while (0)
-
-static const char *op_strings[] = { "ZERO",    "ZEROSEEK", "ADD",
-                                    "MINUS",   "READ",     "PUT",
-                                    "JMP_FWD", "JMP_BCK",  "END" };
-
-typedef enum {
-  ZERO,
-  ZEROSEEK,
-  ADD,
-  MINUS,
-  READ,
-  PUT,
-  JMP_FWD,
-  JMP_BCK,
-  END
-} op_code;
+#define COUNT_READ(j)                                                          \
+  if (heat)                                                                    \
+    heat->reads[j]++;
+#define COUNT_WRITE(j)                                                         \
+  if (heat)                                                                    \
+    heat->writes[j]++;
+#define COUNT_MOVE(delta)                                                      \
+  if (heat)                                                                    \
+    heat->moves[MAX_DELTA + clamp_delta(delta)]++;
+
+#ifdef _BF_LOOP_PROBES
+#define LOOP_PROBE(pos) PROBE1(loop__entry, pos)
+#else
+#define LOOP_PROBE(pos)
+#endif
 
 #ifdef DEBUG
 #include <locale.h>
@@ -91,27 +88,22 @@ static int ncalls[LEN(op_strings)] = { 0 };
 #endif
 
 typedef struct {
-  op_code code;
-  ssize_t arg, offset;
-} op;
-
-typedef struct {
-  op *ops;
-  size_t n, len;
-} program_t;
-
-typedef struct {
-  ptrdiff_t data[STACK_SIZE];
-  size_t len;
-} lifo;
+  uint64_t reads[TAPE_SIZE], writes[TAPE_SIZE];
+  uint64_t moves[2 * MAX_DELTA + 1];
+} heatmap;
 
 static const char *progname;
 
 static struct option longopts[] = {
-  {"help",       no_argument, NULL, 'h'},
-  { "print-ast", no_argument, NULL, 'p'},
-  { "version",   no_argument, NULL, 'v'},
-  { NULL,        no_argument, NULL, 0  }
+  {"help",              no_argument,       NULL, 'h'},
+  { "emit-c",           no_argument,       NULL, 'c'},
+  { "perf-counters",    optional_argument, NULL, 'C'},
+  { "heatmap",          required_argument, NULL, 'H'},
+  { "print-ast",        no_argument,       NULL, 'p'},
+  { "profile-generate", required_argument, NULL, 'P'},
+  { "stats",            optional_argument, NULL, 'S'},
+  { "version",          no_argument,       NULL, 'v'},
+  { NULL,               no_argument,       NULL, 0  }
 };
 
 void version(void) {
@@ -130,202 +122,318 @@ void help(void) {
   printf("\n");
   printf("A simple brainfuck interpreter.\n\n"
          "Options:\n"
+         "  -c, --emit-c\t\t Print infile as a standalone C program\n"
+         "  -C, --perf-counters[=FORMAT]\n"
+         "\t\t\t Print hardware counters of the run to stderr as\n"
+         "\t\t\t text (default) or json\n"
          "  -h, --help\t\t Useless help message\n"
+         "  -H, --heatmap FILE\t Write per-cell reads and writes and pointer\n"
+         "\t\t\t moves to FILE as CSV\n"
          "  -p, --print-ast\t Print parsed AST without executing infile\n"
+         "  -P, --profile-generate FILE\n"
+         "\t\t\t Record loop counts for aot --profile-use in FILE\n"
+         "  -S, --stats[=FORMAT]\t Print timings and counters to stderr as\n"
+         "\t\t\t text (default) or json\n"
          "  -v, --version\t\t Print version number\n");
 }
 
-program_t *init_program(size_t capacity) {
-  program_t *p;
-  if (!(p = malloc(sizeof(program_t))) ||
-      !(p->ops = malloc(capacity * sizeof(op))))
-    err(EXIT_FAILURE, NULL);
-
-  p->n = 0;
-  p->len = capacity;
-
-  return p;
-}
+static const char *c_prelude =
+    "#include <errno.h>\n"
+    "#include <stdint.h>\n"
+    "#include <stdlib.h>\n"
+    "#include <unistd.h>\n"
+    "\n"
+    "#define TAPE_SIZE %d\n"
+    "#define BUF_SIZE %d\n"
+    "\n"
+    "static uint8_t tape[TAPE_SIZE];\n"
+    "static uint8_t in_buf[BUF_SIZE], out_buf[BUF_SIZE];\n"
+    "static size_t in_pos, in_len, out_len;\n"
+    "\n"
+    "static void flush(void) {\n"
+    "  ssize_t n;\n"
+    "  for (size_t i = 0; i < out_len; i += n) {\n"
+    "    if ((n = write(1, out_buf + i, out_len - i)) > 0)\n"
+    "      continue;\n"
+    "    if (n < 0 && errno == EINTR) {\n"
+    "      n = 0;\n"
+    "      continue;\n"
+    "    }\n"
+    "\n"
+    "    static const char message[] = \"write: output error\\n\";\n"
+    "    write(2, message, sizeof(message) - 1);\n"
+    "    _exit(EXIT_FAILURE);\n"
+    "  }\n"
+    "\n"
+    "  out_len = 0;\n"
+    "}\n"
+    "\n"
+    "static inline void put(uint8_t c) {\n"
+    "  out_buf[out_len++] = c;\n"
+    "  if (out_len == BUF_SIZE)\n"
+    "    flush();\n"
+    "}\n"
+    "\n"
+    "static inline uint8_t get(void) {\n"
+    "  if (in_pos == in_len) {\n"
+    "    flush();\n"
+    "\n"
+    "    ssize_t n = read(0, in_buf, BUF_SIZE);\n"
+    "    if (n <= 0)\n"
+    "      return (uint8_t) -1;\n"
+    "\n"
+    "    in_pos = 0;\n"
+    "    in_len = n;\n"
+    "  }\n"
+    "\n"
+    "  return in_buf[in_pos++];\n"
+    "}\n"
+    "\n"
+    "int main(void) {\n"
+    "  uint8_t *p = tape;\n"
+    "\n";
 
-void resize_program(program_t *program) {
-  program->len *= 2;
-  if (!(program->ops = reallocarray(program->ops, program->len, sizeof(op))))
-    err(EXIT_FAILURE, NULL);
-}
-
-void add_op(program_t *program, op_code code, ssize_t arg, ssize_t offset) {
-  if (program->n == program->len)
-    resize_program(program);
-
-  program->ops[program->n] = (op){ .code = code, .arg = arg, .offset = offset };
-  program->n++;
-}
-
-void pop_op(program_t *program) {
-  if (program->n > 0)
-    program->n--;
-}
-
-op *last_op(program_t *program) {
-  return (program->n > 0) ? &program->ops[program->n - 1] : NULL;
-}
-
-void destroy_program(program_t **program) {
-  free((*program)->ops);
-  free(*program);
-  *program = NULL;
-}
-
-void print_ast(program_t *program) {
-  for (op *p = program->ops; p && p->code != END; p++)
-    printf("%s(%ld, %ld)\n", op_strings[p->code], p->arg, p->offset);
-
-  printf("END\n\n");
-}
-
-bool is_valid_token(char ch) {
-  return ch == '+' || ch == '-' || ch == '>' || ch == '<' || ch == '.' ||
-         ch == ',' || ch == '[' || ch == ']';
-}
-
-bool is_repeatable_token(char ch) {
-  return ch == '+' || ch == '-';
-}
-
-char *peek(char *s) {
-  int ch;
-  while ((ch = *(++s))) {
-    if (!is_valid_token(ch))
-      continue;
-
-    return s;
-  }
-
-  return NULL;
-}
-
-program_t *parse(char *s) {
-  program_t *program = init_program(PROGRAM_SIZE);
+/*
+ * Prints the program as C with the tape and buffered I/O inlined, so it
+ * can be built offline with whatever compiler flags, PGO or LTO setup is
+ * at hand. Every op maps to a single statement and loops keep their
+ * nesting, which keeps the output readable next to the source.
+ */
+void emit_c(program_t *program) {
+  int depth = 1;
 
-  int ch, prev_token = 0, offset = 0, start_pos = 0;
-  char *next_token = NULL;
-  op *p;
-  ptrdiff_t jmp_pos;
-  lifo jmp_stack = { 0 };
+  printf(c_prelude, TAPE_SIZE, READ_SIZE);
 
-  while ((ch = *s++)) {
-    if (!is_valid_token(ch))
-      continue;
+  for (op *p = program->ops; p->code != END; p++) {
+    if (p->offset != 0)
+      printf("%*sp %c= %ld;\n", depth * 2, "", p->offset < 0 ? '-' : '+',
+             labs(p->offset));
 
-    if (ch == prev_token && is_repeatable_token(ch)) {
-      last_op(program)->arg++;
+    if (p->code == JMP_BCK) {
+      printf("%*s}\n", --depth * 2, "");
       continue;
-    } else {
-      prev_token = ch;
     }
 
-    switch (ch) {
-      case '-':
-        add_op(program, MINUS, 1, offset);
+    printf("%*s", depth * 2, "");
+    switch (p->code) {
+      case SET:
+        printf("*p = %d;\n", (uint8_t) p->arg);
         break;
-      case '+':
-        add_op(program, ADD, 1, offset);
+      case ZEROSEEK:
+        printf("while (*p)\n%*sp %c= %ld;\n", (depth + 1) * 2, "",
+               p->arg < 0 ? '-' : '+', labs(p->arg));
         break;
-      case '<':
-        offset--;
+      case MUL:
+        if (p->arg == 1 || p->arg == -1)
+          printf("p[%ld] %c= *p;\n", p->dst, p->arg < 0 ? '-' : '+');
+        else
+          printf("p[%ld] %c= *p * %ld;\n", p->dst, p->arg < 0 ? '-' : '+',
+                 labs(p->arg));
         break;
-      case '>':
-        offset++;
+      case ADD:
+        printf("*p += %d;\n", (uint8_t) p->arg);
         break;
-      case '.':
-        add_op(program, PUT, 0, offset);
+      case MINUS:
+        printf("*p -= %d;\n", (uint8_t) p->arg);
         break;
-      case ',':
-        add_op(program, READ, 0, offset);
+      case READ:
+        printf("*p = get();\n");
         break;
-      case '[':
-        if (*s == '-' && (next_token = peek(s)) && *next_token == ']') {
-          add_op(program, ZERO, 0, offset);
-          s = next_token + 1;
-        } else {
-          add_op(program, JMP_FWD, 0, offset);
-          PUSH_STACK(jmp_stack, last_op(program) - program->ops);
-        }
+      case PUT:
+        printf("put(*p);\n");
         break;
-      case ']':
-        if (IS_EMPTY_STACK(jmp_stack))
-          errx(EXIT_FAILURE, "Missing opening '['");
-
-        jmp_pos = POP_STACK(jmp_stack);
-        if ((p = last_op(program)) && p->code == JMP_FWD) {
-          start_pos = p->offset;
-          pop_op(program);
-          add_op(program, ZEROSEEK, offset, start_pos);
-        } else {
-          program->ops[jmp_pos].arg = last_op(program) - program->ops + 1;
-          add_op(program, JMP_BCK, jmp_pos, offset);
-        }
+      case JMP_FWD:
+        printf("while (*p) {\n");
+        depth++;
         break;
       default:
         break;
     }
-
-    if (ch != '>' && ch != '<')
-      offset = 0;
   }
 
-  if (!IS_EMPTY_STACK(jmp_stack))
-    errx(EXIT_FAILURE, "Missing closing ']'");
+  printf("\n  flush();\n  return 0;\n}\n");
+}
+
+static inline ssize_t clamp_delta(ssize_t delta) {
+  if (delta < -MAX_DELTA)
+    return -MAX_DELTA;
+  if (delta > MAX_DELTA)
+    return MAX_DELTA;
 
-  add_op(program, END, 0, 0);
-  return program;
+  return delta;
 }
 
-void run(program_t *program) {
+/*
+ * The interpreter proper. `loops` is NULL except for profiling runs,
+ * `high_water` is NULL unless --stats asks for the highest cell touched
+ * and `heat` is NULL unless --heatmap is recording tape accesses.
+ * Forcing this into its callers lets the compiler drop the counters from
+ * the plain copy in run().
+ */
+static inline __attribute__((always_inline)) void
+execute(program_t *program, loop_profile *loops, int *high_water,
+        heatmap *heat) {
   int8_t tape[TAPE_SIZE] = { 0 };
-  int i = 0;
+  int i = 0, top = 0;
 
+  PROBE(run__start);
   for (op *p = program->ops; p->code != END; p++) {
     i += p->offset;
     BOUNDS_CHECK(i);
 
+    if (high_water && i > top)
+      top = i;
+
+    COUNT_MOVE(p->offset);
+
     TRACE(p->code);
     switch (p->code) {
-      case ZERO:
-        tape[i] = 0;
+      case SET:
+        COUNT_WRITE(i);
+        tape[i] = p->arg;
         break;
       case ZEROSEEK:
         while (tape[i] != 0) {
+          COUNT_READ(i);
+          COUNT_MOVE(p->arg);
           i += p->arg;
           BOUNDS_CHECK(i);
         }
+
+        COUNT_READ(i);
+        if (high_water && i > top)
+          top = i;
+        break;
+      case MUL:
+        BOUNDS_CHECK((int) (i + p->dst));
+        if (high_water && i + p->dst > top)
+          top = i + p->dst;
+
+        COUNT_READ(i);
+        COUNT_WRITE(i + p->dst);
+        tape[i + p->dst] += tape[i] * p->arg;
         break;
       case ADD:
         OVERFLOW_CHECK(tape, i, p->arg);
+        COUNT_WRITE(i);
         tape[i] += p->arg;
         break;
       case MINUS:
         UNDERFLOW_CHECK(tape, i, p->arg);
+        COUNT_WRITE(i);
         tape[i] -= p->arg;
         break;
       case READ:
-        tape[i] = getchar_unlocked();
+        COUNT_WRITE(i);
+        tape[i] = rt_get();
         break;
       case PUT:
-        putchar_unlocked(tape[i]);
+        COUNT_READ(i);
+        rt_put(tape[i]);
         break;
       case JMP_FWD:
-        if (tape[i] == 0)
+        COUNT_READ(i);
+        LOOP_PROBE(p->pos);
+        if (loops)
+          loops[p - program->ops].entries++;
+
+        if (tape[i] == 0) {
+          if (loops)
+            loops[p - program->ops].skips++;
+
           p = &program->ops[p->arg];
+        }
         break;
       case JMP_BCK:
-        if (tape[i] != 0)
+        COUNT_READ(i);
+        if (tape[i] != 0) {
+          if (loops)
+            loops[p->arg].backedges++;
+
+          rt_backedges++;
+          if (rt_progress)
+            rt_report(p->pos, i);
+
           p = &program->ops[p->arg];
+        }
         break;
       default:
         break;
     }
   }
+
+  PROBE(run__done);
+
+  if (high_water)
+    *high_water = top;
+}
+
+void run(program_t *program) {
+  execute(program, NULL, NULL, NULL);
+}
+
+int run_measured(program_t *program) {
+  int high_water;
+  execute(program, NULL, &high_water, NULL);
+  return high_water;
+}
+
+/*
+ * Writes the heatmap in long form, one `kind,key,count` row per nonzero
+ * counter: reads and writes are keyed by cell and moves by pointer
+ * delta, with deltas beyond the tape size folded into the largest one.
+ */
+void write_heatmap(char *file, heatmap *heat) {
+  FILE *fp;
+  if (!(fp = fopen(file, "w")))
+    err(EXIT_FAILURE, "%s", file);
+
+  fprintf(fp, "kind,key,count\n");
+  for (int i = 0; i < TAPE_SIZE; i++)
+    if (heat->reads[i])
+      fprintf(fp, "read,%d,%" PRIu64 "\n", i, heat->reads[i]);
+
+  for (int i = 0; i < TAPE_SIZE; i++)
+    if (heat->writes[i])
+      fprintf(fp, "write,%d,%" PRIu64 "\n", i, heat->writes[i]);
+
+  for (int i = 0; i < 2 * MAX_DELTA + 1; i++)
+    if (heat->moves[i])
+      fprintf(fp, "move,%d,%" PRIu64 "\n", i - MAX_DELTA, heat->moves[i]);
+
+  if (fclose(fp) == EOF)
+    err(EXIT_FAILURE, "%s", file);
+}
+
+void run_heatmap(program_t *program, char *file) {
+  heatmap *heat;
+  if (!(heat = calloc(1, sizeof(heatmap))))
+    err(EXIT_FAILURE, NULL);
+
+  execute(program, NULL, NULL, heat);
+
+  write_heatmap(file, heat);
+  free(heat);
+}
+
+void run_profiled(program_t *program, char *file, uint64_t hash) {
+  loop_profile *loops;
+  if (!(loops = calloc(program->n, sizeof(loop_profile))))
+    err(EXIT_FAILURE, NULL);
+
+  execute(program, loops, NULL, NULL);
+
+  profile_t profile = { .hash = hash, .loops = loops, .n = 0 };
+  for (size_t k = 0; k < program->n; k++) {
+    if (program->ops[k].code != JMP_FWD)
+      continue;
+
+    loops[k].pos = program->ops[k].pos;
+    loops[profile.n++] = loops[k];
+  }
+
+  write_profile(file, &profile);
+  free(loops);
 }
 
 void read_file(char *file, char *buffer) {
@@ -351,9 +459,11 @@ void read_file(char *file, char *buffer) {
 int main(int argc, char *argv[]) {
   progname = basename(argv[0]);
 
-  bool debug_ast = false;
+  bool debug_ast = false, transpile = false, measure = false;
+  char *profile = NULL, *heatmap_file = NULL;
   int opt;
-  if ((opt = getopt_long(argc, argv, "hpv", longopts, NULL)) != -1) {
+  const char *optstring = "cC::hH:pP:S::v";
+  while ((opt = getopt_long(argc, argv, optstring, longopts, NULL)) != -1) {
     switch (opt) {
       case 'h':
         help();
@@ -361,9 +471,25 @@ int main(int argc, char *argv[]) {
       case 'v':
         version();
         exit(EXIT_SUCCESS);
+      case 'c':
+        transpile = true;
+        break;
+      case 'C':
+        enable_counters("bf", parse_stats_format(optarg));
+        break;
+      case 'H':
+        heatmap_file = optarg;
+        break;
       case 'p':
         debug_ast = true;
         break;
+      case 'P':
+        profile = optarg;
+        break;
+      case 'S':
+        enable_stats("bf", parse_stats_format(optarg));
+        measure = true;
+        break;
       default:
         usage(stderr);
         exit(EXIT_FAILURE);
@@ -375,15 +501,42 @@ int main(int argc, char *argv[]) {
     errx(EXIT_FAILURE, "No input file");
   }
 
+  if (heatmap_file && (transpile || profile))
+    errx(EXIT_FAILURE,
+         "--heatmap cannot be combined with --emit-c or --profile-generate");
+
   char buffer[MAX_FILE_SIZE] = { 0 };
   read_file(argv[optind], buffer);
+  rt_watch_progress();
 
+  uint64_t start = monotonic_ns();
   program_t *program = parse(buffer);
+  stats.parse = monotonic_ns() - start;
+  stats.ops = program->n;
 
-  if (debug_ast)
+  if (debug_ast) {
     print_ast(program);
+    fflush(stdout);
+  }
 
-  run(program);
+  start = monotonic_ns();
+  start_counters();
+  if (transpile)
+    emit_c(program);
+  else if (profile)
+    run_profiled(program, profile,
+                 hash_bytes(FNV_OFFSET, buffer, strlen(buffer)));
+  else if (heatmap_file)
+    run_heatmap(program, heatmap_file);
+  else if (measure)
+    stats.tape_high_water = run_measured(program);
+  else
+    run(program);
+
+  rt_flush();
+  stop_counters();
+  if (!transpile)
+    stats.run = monotonic_ns() - start;
 
 #ifdef DEBUG
   setlocale(LC_NUMERIC, "");
@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2023, Joshua Krusell
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * C interface of brainfuck kernels compiled with `aot -k obj` or
+ * `aot -k lib`. A kernel runs the whole program against a caller-owned
+ * tape of at least BF_TAPE_SIZE cells, starting at the first cell, and
+ * routes all I/O through the given callbacks. `io` is passed through
+ * untouched. A `get` result outside of 0-255 (e.g. EOF) is truncated to
+ * a cell like getchar would be.
+ *
+ *   BF_KERNEL(hello);
+ *
+ *   uint8_t tape[BF_TAPE_SIZE] = { 0 };
+ *   hello(tape, my_get, my_put, my_state);
+ */
+
+#ifndef BF_H
+#define BF_H
+
+#include <stdint.h>
+
+#define BF_TAPE_SIZE 30000
+
+typedef int (*bf_get_fn)(void *io);
+typedef void (*bf_put_fn)(int c, void *io);
+
+#define BF_KERNEL(name)                                                        \
+  void name(uint8_t *tape, bf_get_fn get, bf_put_fn put, void *io)
+
+#endif
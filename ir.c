@@ -0,0 +1,487 @@
+/*
+ * Copyright (c) 2023, Joshua Krusell
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <err.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ir.h"
+#include "probes.h"
+
+#define PROFILE_MAGIC "bf-profile 1"
+
+#define MAX_MUL_TARGETS 16
+
+#define IS_EMPTY_STACK(stack) (stack.len == 0)
+#define POP_STACK(stack) stack.data[--stack.len]
+#define PUSH_STACK(stack, x)                                                   \
+  do {                                                                         \
+    if (stack.len == STACK_SIZE)                                               \
+      errx(EXIT_FAILURE, "Nested loops exceeded stack size");                  \
+    stack.data[stack.len++] = x;                                               \
+  } while (0)
+
+typedef struct {
+  ptrdiff_t data[STACK_SIZE];
+  size_t len;
+} lifo;
+
+typedef struct {
+  ssize_t pos, delta;
+} mul_target;
+
+typedef struct {
+  uint64_t hash;
+  size_t start;
+} loop_key;
+
+const char *op_strings[NUM_OPS] = { "SET", "ZEROSEEK", "MUL",
+                                    "ADD", "MINUS",    "READ",
+                                    "PUT", "JMP_FWD",  "JMP_BCK",
+                                    "END" };
+
+program_t *init_program(size_t capacity) {
+  program_t *p;
+  if (!(p = malloc(sizeof(program_t))) ||
+      !(p->ops = malloc(capacity * sizeof(op))))
+    err(EXIT_FAILURE, NULL);
+
+  p->n = 0;
+  p->len = capacity;
+
+  return p;
+}
+
+void resize_program(program_t *program) {
+  program->len *= 2;
+  if (!(program->ops = reallocarray(program->ops, program->len, sizeof(op))))
+    err(EXIT_FAILURE, NULL);
+}
+
+void add_op(program_t *program, op_code code, ssize_t arg, ssize_t offset,
+            size_t pos) {
+  if (program->n == program->len)
+    resize_program(program);
+
+  program->ops[program->n] = (op){
+    .code = code, .arg = arg, .offset = offset, .dst = 0, .pos = pos
+  };
+  program->n++;
+}
+
+void pop_op(program_t *program) {
+  if (program->n > 0)
+    program->n--;
+}
+
+op *last_op(program_t *program) {
+  return (program->n > 0) ? &program->ops[program->n - 1] : NULL;
+}
+
+void destroy_program(program_t **program) {
+  free((*program)->ops);
+  free(*program);
+  *program = NULL;
+}
+
+void print_ast(program_t *program) {
+  for (op *p = program->ops; p && p->code != END; p++) {
+    if (p->code == MUL)
+      printf("%s(%ld, %ld, %ld)\n", op_strings[p->code], p->arg, p->offset,
+             p->dst);
+    else
+      printf("%s(%ld, %ld)\n", op_strings[p->code], p->arg, p->offset);
+  }
+
+  printf("END\n\n");
+}
+
+bool is_valid_token(char ch) {
+  return ch == '+' || ch == '-' || ch == '>' || ch == '<' || ch == '.' ||
+         ch == ',' || ch == '[' || ch == ']';
+}
+
+bool is_repeatable_token(char ch) {
+  return ch == '+' || ch == '-';
+}
+
+char *peek(char *s) {
+  int ch;
+  while ((ch = *(++s))) {
+    if (!is_valid_token(ch))
+      continue;
+
+    return s;
+  }
+
+  return NULL;
+}
+
+/*
+ * Replaces a loop body starting after `start` that only adds to cells
+ * at fixed positions, returns to its starting cell (`offset` being the
+ * pointer movement before the closing ']') and steps its counter by
+ * exactly one, with a MUL per target cell followed by a SET to zero.
+ */
+bool fold_mul_loop(program_t *program, size_t start, ssize_t offset) {
+  mul_target targets[MAX_MUL_TARGETS];
+  size_t ntargets = 0, i;
+  ssize_t pos = 0, delta, step = 0;
+
+  for (op *p = &program->ops[start + 1]; p < program->ops + program->n; p++) {
+    if (p->code != ADD && p->code != MINUS)
+      return false;
+
+    pos += p->offset;
+    delta = (p->code == ADD) ? p->arg : -p->arg;
+
+    for (i = 0; i < ntargets && targets[i].pos != pos; i++)
+      ;
+
+    if (i == ntargets) {
+      if (ntargets == MAX_MUL_TARGETS)
+        return false;
+
+      targets[ntargets++] = (mul_target){ .pos = pos, .delta = 0 };
+    }
+
+    targets[i].delta += delta;
+  }
+
+  if (pos + offset != 0)
+    return false;
+
+  for (i = 0; i < ntargets; i++) {
+    if (targets[i].pos == 0)
+      step = (int8_t) targets[i].delta;
+  }
+
+  if (step != 1 && step != -1)
+    return false;
+
+  // A counter stepping upwards reaches zero after (256 - n) iterations,
+  // i.e. -n modulo the cell size, so the factors flip sign.
+  ssize_t entry = program->ops[start].offset;
+  size_t loop_pos = program->ops[start].pos;
+  program->n = start;
+
+  for (i = 0; i < ntargets; i++) {
+    if (targets[i].pos == 0 || (uint8_t) targets[i].delta == 0)
+      continue;
+
+    add_op(program, MUL, -step * targets[i].delta, entry, loop_pos);
+    last_op(program)->dst = targets[i].pos;
+    entry = 0;
+  }
+
+  add_op(program, SET, 0, entry, loop_pos);
+  return true;
+}
+
+program_t *parse(char *s) {
+  PROBE(parse__start);
+
+  program_t *program = init_program(PROGRAM_SIZE);
+  char *source = s;
+  size_t pos;
+
+  int ch, prev_token = 0, offset = 0, start_pos = 0;
+  char *next_token = NULL;
+  op *p;
+  ptrdiff_t jmp_pos;
+  lifo jmp_stack = { 0 };
+
+  while ((ch = *s++)) {
+    if (!is_valid_token(ch))
+      continue;
+
+    pos = s - 1 - source;
+    if (ch == prev_token && is_repeatable_token(ch)) {
+      p = last_op(program);
+      p->arg += (p->code == SET && ch == '-') ? -1 : 1;
+      continue;
+    } else {
+      prev_token = ch;
+    }
+
+    // Arithmetic right after a store, e.g. `[-]+++`, folds into the store
+    if ((ch == '+' || ch == '-') && offset == 0 && (p = last_op(program)) &&
+        p->code == SET) {
+      p->arg += (ch == '+') ? 1 : -1;
+      continue;
+    }
+
+    switch (ch) {
+      case '-':
+        add_op(program, MINUS, 1, offset, pos);
+        break;
+      case '+':
+        add_op(program, ADD, 1, offset, pos);
+        break;
+      case '<':
+        offset--;
+        break;
+      case '>':
+        offset++;
+        break;
+      case '.':
+        add_op(program, PUT, 0, offset, pos);
+        break;
+      case ',':
+        add_op(program, READ, 0, offset, pos);
+        break;
+      case '[':
+        if (*s == '-' && (next_token = peek(s)) && *next_token == ']') {
+          add_op(program, SET, 0, offset, pos);
+          s = next_token + 1;
+        } else {
+          add_op(program, JMP_FWD, 0, offset, pos);
+          PUSH_STACK(jmp_stack, last_op(program) - program->ops);
+        }
+        break;
+      case ']':
+        if (IS_EMPTY_STACK(jmp_stack))
+          errx(EXIT_FAILURE, "Missing opening '['");
+
+        jmp_pos = POP_STACK(jmp_stack);
+        if ((p = last_op(program)) && p->code == JMP_FWD) {
+          start_pos = p->offset;
+          pos = p->pos;
+          pop_op(program);
+          add_op(program, ZEROSEEK, offset, start_pos, pos);
+        } else if (!fold_mul_loop(program, jmp_pos, offset)) {
+          program->ops[jmp_pos].arg = last_op(program) - program->ops + 1;
+          add_op(program, JMP_BCK, jmp_pos, offset, pos);
+        }
+        break;
+      default:
+        break;
+    }
+
+    if (ch != '>' && ch != '<')
+      offset = 0;
+  }
+
+  if (!IS_EMPTY_STACK(jmp_stack))
+    errx(EXIT_FAILURE, "Missing closing ']'");
+
+  add_op(program, END, 0, 0, s - 1 - source);
+
+  PROBE1(parse__done, program->n);
+  return program;
+}
+
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t len) {
+  const unsigned char *s = data;
+  for (size_t i = 0; i < len; i++)
+    hash = (hash ^ s[i]) * FNV_PRIME;
+
+  return hash;
+}
+
+// Hash of every op field, for keys that must change with the parser
+uint64_t hash_program(program_t *program) {
+  uint64_t hash = FNV_OFFSET;
+  for (size_t k = 0; k < program->n; k++) {
+    op *p = &program->ops[k];
+    ssize_t fields[5] = { p->code, p->arg, p->offset, p->dst, p->pos };
+    hash = hash_bytes(hash, fields, sizeof(fields));
+  }
+
+  return hash;
+}
+
+// Hash of a loop body with jump targets relative to the loop
+uint64_t hash_loop(program_t *program, size_t start) {
+  uint64_t hash = FNV_OFFSET;
+  for (size_t k = start + 1; k <= (size_t) program->ops[start].arg; k++) {
+    op *p = &program->ops[k];
+    ssize_t fields[4] = { p->code, p->arg, p->offset, p->dst };
+    if (p->code == JMP_FWD || p->code == JMP_BCK)
+      fields[1] -= start;
+
+    hash = hash_bytes(hash, fields, sizeof(fields));
+  }
+
+  return hash;
+}
+
+bool same_loop(program_t *program, size_t a, size_t b) {
+  size_t len = program->ops[a].arg - a;
+  if ((size_t) program->ops[b].arg - b != len)
+    return false;
+
+  for (size_t i = 1; i <= len; i++) {
+    op *x = &program->ops[a + i], *y = &program->ops[b + i];
+    if (x->code != y->code || x->offset != y->offset || x->dst != y->dst)
+      return false;
+
+    if (x->code == JMP_FWD || x->code == JMP_BCK) {
+      if (x->arg - (ssize_t) a != y->arg - (ssize_t) b)
+        return false;
+    } else if (x->arg != y->arg) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+int compare_loops(const void *a, const void *b) {
+  const loop_key *x = a, *y = b;
+  if (x->hash != y->hash)
+    return x->hash < y->hash ? -1 : 1;
+
+  return (x->start > y->start) - (x->start < y->start);
+}
+
+/*
+ * Hash-conses loops of at least min_ops ops. Returns, for every JMP_FWD
+ * whose loop occurs more than once, the index of its first occurrence,
+ * and NO_LOOP everywhere else. The pointer move on the JMP_FWD itself
+ * happens before the loop and is not part of its identity.
+ */
+size_t *find_duplicate_loops(program_t *program, size_t min_ops) {
+  size_t *ids, *count, n = 0;
+  loop_key *keys;
+  if (!(ids = malloc(program->n * sizeof(size_t))) ||
+      !(count = calloc(program->n, sizeof(size_t))) ||
+      !(keys = malloc(program->n * sizeof(loop_key))))
+    err(EXIT_FAILURE, NULL);
+
+  for (size_t k = 0; k < program->n; k++) {
+    ids[k] = NO_LOOP;
+    if (program->ops[k].code == JMP_FWD &&
+        (size_t) program->ops[k].arg - k + 1 >= min_ops)
+      keys[n++] = (loop_key){ .hash = hash_loop(program, k), .start = k };
+  }
+
+  qsort(keys, n, sizeof(loop_key), compare_loops);
+
+  for (size_t i = 0; i < n; i++) {
+    size_t rep = keys[i].start;
+    for (size_t j = i; j-- > 0 && keys[j].hash == keys[i].hash;) {
+      if (ids[keys[j].start] == keys[j].start &&
+          same_loop(program, keys[j].start, keys[i].start)) {
+        rep = keys[j].start;
+        break;
+      }
+    }
+
+    ids[keys[i].start] = rep;
+    count[rep]++;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    size_t k = keys[i].start;
+    if (count[ids[k]] < 2)
+      ids[k] = NO_LOOP;
+  }
+
+  free(keys);
+  free(count);
+  return ids;
+}
+
+void write_profile(char *file, profile_t *profile) {
+  FILE *fp;
+  if (!(fp = fopen(file, "w")))
+    err(EXIT_FAILURE, "%s", file);
+
+  fprintf(fp, "%s %016" PRIx64 "\n", PROFILE_MAGIC, profile->hash);
+  for (size_t i = 0; i < profile->n; i++) {
+    loop_profile *l = &profile->loops[i];
+    fprintf(fp, "%zu %" PRIu64 " %" PRIu64 " %" PRIu64 "\n", l->pos,
+            l->entries, l->skips, l->backedges);
+  }
+
+  if (fclose(fp) == EOF)
+    err(EXIT_FAILURE, "%s", file);
+}
+
+profile_t *read_profile(char *file) {
+  FILE *fp;
+  if (!(fp = fopen(file, "r")))
+    err(EXIT_FAILURE, "%s", file);
+
+  profile_t *profile;
+  if (!(profile = malloc(sizeof(profile_t))))
+    err(EXIT_FAILURE, NULL);
+
+  char magic[sizeof(PROFILE_MAGIC)];
+  if (!fgets(magic, sizeof(magic), fp) || strcmp(magic, PROFILE_MAGIC) != 0 ||
+      fscanf(fp, "%" SCNx64, &profile->hash) != 1)
+    errx(EXIT_FAILURE, "%s is not a profile", file);
+
+  size_t len = 64;
+  profile->n = 0;
+  if (!(profile->loops = malloc(len * sizeof(loop_profile))))
+    err(EXIT_FAILURE, NULL);
+
+  loop_profile l;
+  while (fscanf(fp, "%zu %" SCNu64 " %" SCNu64 " %" SCNu64, &l.pos,
+                &l.entries, &l.skips, &l.backedges) == 4) {
+    // Back edges are only taken by loops that ran at least once
+    if (l.skips > l.entries || (l.backedges && l.entries == l.skips))
+      errx(EXIT_FAILURE, "Malformed profile %s", file);
+
+    if (profile->n == len &&
+        !(profile->loops =
+              reallocarray(profile->loops, len *= 2, sizeof(loop_profile))))
+      err(EXIT_FAILURE, NULL);
+
+    profile->loops[profile->n++] = l;
+  }
+
+  if (!feof(fp))
+    errx(EXIT_FAILURE, "Malformed profile %s", file);
+
+  fclose(fp);
+  return profile;
+}
+
+// Profiles are written in op order, which is also source order
+loop_profile *find_loop_profile(profile_t *profile, size_t pos) {
+  size_t lo = 0, hi = profile->n;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (profile->loops[mid].pos < pos)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return (lo < profile->n && profile->loops[lo].pos == pos)
+             ? &profile->loops[lo]
+             : NULL;
+}
+
+void destroy_profile(profile_t **profile) {
+  free((*profile)->loops);
+  free(*profile);
+  *profile = NULL;
+}
@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2023, Joshua Krusell
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef BF_IR_H
+#define BF_IR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define STACK_SIZE 256
+#define PROGRAM_SIZE 4096
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+/*
+ * Every op first moves the tape pointer by `offset` and then applies
+ * itself to the current cell. `arg` is the value stored by SET, the
+ * repeat count for ADD/MINUS, the stride for ZEROSEEK, the factor for
+ * MUL and the index of the matching jump for JMP_FWD/JMP_BCK. MUL
+ * additionally adds `arg` times the current cell to the cell at relative
+ * position `dst` without moving the pointer. `pos` is the byte offset in
+ * the source of the token an op was parsed from; folded loops take the
+ * position of their opening '['.
+ */
+typedef enum {
+  SET,
+  ZEROSEEK,
+  MUL,
+  ADD,
+  MINUS,
+  READ,
+  PUT,
+  JMP_FWD,
+  JMP_BCK,
+  END
+} op_code;
+
+#define NUM_OPS (END + 1)
+
+#define NO_LOOP SIZE_MAX
+
+typedef struct {
+  op_code code;
+  ssize_t arg, offset, dst;
+  size_t pos;
+} op;
+
+typedef struct {
+  op *ops;
+  size_t n, len;
+} program_t;
+
+/*
+ * Execution counts of a loop, keyed by the source position of its '['.
+ * `skips` counts entries where the loop body did not run at all and
+ * `backedges` the jumps from ']' back to the start of the body.
+ */
+typedef struct {
+  size_t pos;
+  uint64_t entries, skips, backedges;
+} loop_profile;
+
+typedef struct {
+  uint64_t hash;
+  loop_profile *loops;
+  size_t n;
+} profile_t;
+
+extern const char *op_strings[NUM_OPS];
+
+program_t *init_program(size_t capacity);
+void add_op(program_t *program, op_code code, ssize_t arg, ssize_t offset,
+            size_t pos);
+void pop_op(program_t *program);
+op *last_op(program_t *program);
+void destroy_program(program_t **program);
+
+void print_ast(program_t *program);
+program_t *parse(char *s);
+
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t len);
+uint64_t hash_program(program_t *program);
+size_t *find_duplicate_loops(program_t *program, size_t min_ops);
+
+void write_profile(char *file, profile_t *profile);
+profile_t *read_profile(char *file);
+loop_profile *find_loop_profile(profile_t *profile, size_t pos);
+void destroy_profile(profile_t **profile);
+
+#endif
@@ -21,22 +21,44 @@
  * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include <elf.h>
 #include <err.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <jit/jit.h>
 #include <libgen.h>
+#include <limits.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
+#include "probes.h"
+#include "rt.h"
+#include "stats.h"
+
 #define READ_SIZE 1024 * 8
 #define MAX_FILE_SIZE 1024 * 1024 * 8
 #define TAPE_SIZE 30000
 #define STACK_SIZE 256
 
+#define JITDUMP_MAGIC 0x4A695444
+#define JITDUMP_VERSION 1
+#define JIT_CODE_LOAD 0
+
+#if defined(__x86_64__)
+#define JITDUMP_MACH EM_X86_64
+#elif defined(__aarch64__)
+#define JITDUMP_MACH EM_AARCH64
+#else
+#define JITDUMP_MACH EM_NONE
+#endif
+
 #define OP_ARG(fn, x) jit_value_create_nint_constant(fn, jit_type_ubyte, 1 + x)
 
 #define IS_EMPTY_STACK(stack) (stack.len == 0)
@@ -60,15 +82,33 @@ typedef struct {
   size_t len;
 } lifo;
 
+// Layouts from tools/perf/Documentation/jitdump-specification.txt
+typedef struct {
+  uint32_t magic, version, total_size, elf_mach, pad1, pid;
+  uint64_t timestamp, flags;
+} jitdump_header;
+
+typedef struct {
+  uint32_t id, total_size;
+  uint64_t timestamp;
+  uint32_t pid, tid;
+  uint64_t vma, code_addr, code_size, code_index;
+} jitdump_code_load;
+
 typedef void (*BF_program)(void *);
 
 static const char *progname;
 
 static struct option longopts[] = {
-  {"help",     no_argument, NULL, 'h'},
-  { "print",   no_argument, NULL, 'p'},
-  { "version", no_argument, NULL, 'v'},
-  { NULL,      no_argument, NULL, 0  }
+  {"help",           no_argument,       NULL, 'h'},
+  { "perf-counters", optional_argument, NULL, 'C'},
+  { "jitdump",       no_argument,       NULL, 'j'},
+  { "perf-map",      no_argument,       NULL, 'm'},
+  { "print",         no_argument,       NULL, 'p'},
+  { "progress",      no_argument,       NULL, 'r'},
+  { "stats",         optional_argument, NULL, 'S'},
+  { "version",       no_argument,       NULL, 'v'},
+  { NULL,            no_argument,       NULL, 0  }
 };
 
 void version(void) {
@@ -85,8 +125,17 @@ void help(void) {
   printf("\n");
   printf("A simple brainfuck JIT compiler.\n\n"
          "Options:\n"
+         "  -C, --perf-counters[=FORMAT]\n"
+         "\t\t\t Print hardware counters of the run to stderr as\n"
+         "\t\t\t text (default) or json\n"
          "  -h, --help\t\t Useless help message\n"
+         "  -j, --jitdump\t\t Write jitdump records for perf inject\n"
+         "  -m, --perf-map\t Write /tmp/perf-<pid>.map for perf\n"
          "  -p, --print\t\t Print libjit instructions\n"
+         "  -r, --progress\t Count loop iterations and report them on "
+         "SIGUSR1\n"
+         "  -S, --stats[=FORMAT]\t Print timings and counters to stderr as\n"
+         "\t\t\t text (default) or json\n"
          "  -v, --version\t\t Print version number\n");
 }
 
@@ -111,17 +160,109 @@ char *peek(char *s) {
   return NULL;
 }
 
-void compile_bf(jit_function_t fn, char *s) {
-  jit_type_t putchar_params[1] = { jit_type_int };
-  jit_type_t putchar_sig = jit_type_create_signature(
-      jit_abi_cdecl, jit_type_int, putchar_params, 1, 1);
+jit_value_t buffer_field(jit_function_t fn, rt_buffer *buf, size_t field) {
+  jit_value_t ptr =
+      jit_value_create_nint_constant(fn, jit_type_void_ptr, (jit_nint) buf);
+  return jit_insn_load_relative(fn, ptr, field, jit_type_nuint);
+}
+
+void set_buffer_field(jit_function_t fn, rt_buffer *buf, size_t field,
+                      jit_value_t value) {
+  jit_value_t ptr =
+      jit_value_create_nint_constant(fn, jit_type_void_ptr, (jit_nint) buf);
+  jit_insn_store_relative(fn, ptr, field, value);
+}
+
+// Inline copy of rt_put()
+void emit_put(jit_function_t fn, jit_value_t c, jit_type_t flush_sig) {
+  jit_label_t done = jit_label_undefined;
+  jit_value_t one = jit_value_create_nint_constant(fn, jit_type_nuint, 1);
+  jit_value_t size =
+      jit_value_create_nint_constant(fn, jit_type_nuint, RT_BUF_SIZE);
+
+  jit_value_t len = buffer_field(fn, &rt_out, offsetof(rt_buffer, len));
+  jit_value_t base = jit_value_create_nint_constant(fn, jit_type_void_ptr,
+                                                    (jit_nint) rt_out.data);
+  jit_insn_store_relative(fn, jit_insn_add(fn, base, len), 0, c);
+
+  len = jit_insn_add(fn, len, one);
+  set_buffer_field(fn, &rt_out, offsetof(rt_buffer, len), len);
+
+  jit_insn_branch_if(fn, jit_insn_ne(fn, len, size), &done);
+  jit_insn_call_native(fn, "rt_flush", rt_flush, flush_sig, NULL, 0,
+                       JIT_CALL_NOTHROW);
+  jit_insn_label(fn, &done);
+}
+
+// Inline copy of rt_get(), storing the result straight into `cell`
+void emit_get(jit_function_t fn, jit_value_t cell, jit_type_t fill_sig) {
+  jit_label_t slow = jit_label_undefined, done = jit_label_undefined;
+  jit_value_t one = jit_value_create_nint_constant(fn, jit_type_nuint, 1);
+
+  jit_value_t pos = buffer_field(fn, &rt_in, offsetof(rt_buffer, pos));
+  jit_value_t len = buffer_field(fn, &rt_in, offsetof(rt_buffer, len));
+  jit_insn_branch_if_not(fn, jit_insn_lt(fn, pos, len), &slow);
+
+  jit_value_t base = jit_value_create_nint_constant(fn, jit_type_void_ptr,
+                                                    (jit_nint) rt_in.data);
+  jit_value_t c = jit_insn_load_relative(fn, jit_insn_add(fn, base, pos), 0,
+                                         jit_type_ubyte);
+  jit_insn_store_relative(fn, cell, 0, c);
+  set_buffer_field(fn, &rt_in, offsetof(rt_buffer, pos),
+                   jit_insn_add(fn, pos, one));
+  jit_insn_branch(fn, &done);
+
+  jit_insn_label(fn, &slow);
+  c = jit_insn_call_native(fn, "rt_fill", rt_fill, fill_sig, NULL, 0,
+                           JIT_CALL_NOTHROW);
+  jit_insn_store_relative(fn, cell, 0,
+                          jit_insn_convert(fn, c, jit_type_ubyte, 0));
+  jit_insn_label(fn, &done);
+}
+
+// Counts a taken back edge and calls rt_report() once SIGUSR1 arrived
+void emit_progress(jit_function_t fn, size_t pos, jit_value_t tape,
+                   jit_value_t origin, jit_type_t report_sig) {
+  jit_label_t done = jit_label_undefined;
+  jit_value_t one = jit_value_create_long_constant(fn, jit_type_ulong, 1);
+
+  jit_value_t counter = jit_value_create_nint_constant(
+      fn, jit_type_void_ptr, (jit_nint) &rt_backedges);
+  jit_value_t n = jit_insn_load_relative(fn, counter, 0, jit_type_ulong);
+  jit_insn_store_relative(fn, counter, 0, jit_insn_add(fn, n, one));
+
+  jit_value_t flag = jit_value_create_nint_constant(fn, jit_type_void_ptr,
+                                                    (jit_nint) &rt_progress);
+  jit_insn_branch_if_not(fn, jit_insn_load_relative(fn, flag, 0, jit_type_int),
+                         &done);
+
+  jit_value_t args[2] = {
+    jit_value_create_nint_constant(fn, jit_type_nuint, pos),
+    jit_insn_convert(fn, jit_insn_sub(fn, tape, origin), jit_type_nint, 0),
+  };
+  jit_insn_call_native(fn, "rt_report", rt_report, report_sig, args, 2,
+                       JIT_CALL_NOTHROW);
+  jit_insn_label(fn, &done);
+}
 
-  jit_type_t getchar_sig =
+void compile_bf(jit_function_t fn, char *s, bool progress) {
+  jit_type_t flush_sig =
+      jit_type_create_signature(jit_abi_cdecl, jit_type_void, NULL, 0, 1);
+  jit_type_t fill_sig =
       jit_type_create_signature(jit_abi_cdecl, jit_type_int, NULL, 0, 1);
+  jit_type_t report_params[2] = { jit_type_nuint, jit_type_nint };
+  jit_type_t report_sig = jit_type_create_signature(
+      jit_abi_cdecl, jit_type_void, report_params, 2, 1);
 
   jit_value_t zero = jit_value_create_nint_constant(fn, jit_type_ubyte, 0);
   jit_value_t tape = jit_value_get_param(fn, 0);
-  jit_value_t cell, result;
+  jit_value_t cell, result, origin = NULL;
+  char *source = s;
+
+  if (progress) {
+    origin = jit_value_create(fn, jit_type_void_ptr);
+    jit_insn_store(fn, origin, tape);
+  }
 
   lifo jmp_stack = { 0 };
 
@@ -162,13 +303,10 @@ void compile_bf(jit_function_t fn, char *s) {
         break;
       case '.':
         cell = jit_insn_load_relative(fn, tape, 0, jit_type_ubyte);
-        jit_insn_call_native(fn, "putchar_unlocked", putchar_unlocked,
-                             putchar_sig, &cell, 1, JIT_CALL_NOTHROW);
+        emit_put(fn, cell, flush_sig);
         break;
       case ',':
-        result = jit_insn_call_native(fn, "getchar_unlocked", getchar_unlocked,
-                                      getchar_sig, NULL, 0, JIT_CALL_NOTHROW);
-        jit_insn_store_relative(fn, tape, 0, result);
+        emit_get(fn, tape, fill_sig);
         break;
       case '[':
         if (*s == '-' && (next_token = peek(s)) && *next_token == ']') {
@@ -186,7 +324,13 @@ void compile_bf(jit_function_t fn, char *s) {
           errx(EXIT_FAILURE, "Missing opening '['");
 
         cell = jit_insn_load_relative(fn, tape, 0, jit_type_ubyte);
-        jit_insn_branch_if(fn, cell, &LAST_FWD(jmp_stack));
+        if (progress) {
+          jit_insn_branch_if_not(fn, cell, &LAST_BCK(jmp_stack));
+          emit_progress(fn, s - 1 - source, tape, origin, report_sig);
+          jit_insn_branch(fn, &LAST_FWD(jmp_stack));
+        } else {
+          jit_insn_branch_if(fn, cell, &LAST_FWD(jmp_stack));
+        }
         jit_insn_label(fn, &LAST_BCK(jmp_stack));
 
         POP_JMP(jmp_stack);
@@ -201,12 +345,115 @@ void compile_bf(jit_function_t fn, char *s) {
   if (!IS_EMPTY_STACK(jmp_stack))
     errx(EXIT_FAILURE, "Missing closing ']'");
 
-  jit_type_free(putchar_sig);
-  jit_type_free(getchar_sig);
+  jit_type_free(flush_sig);
+  jit_type_free(fill_sig);
+  jit_type_free(report_sig);
 
   jit_insn_return(fn, NULL);
 }
 
+/*
+ * libjit does not expose the size of compiled code, but functions are
+ * contiguous in its code cache, so search for the last address that
+ * still maps back to fn.
+ */
+size_t code_size(jit_context_t ctx, jit_function_t fn, uint8_t *start) {
+  size_t hi = 1;
+  while (jit_function_from_pc(ctx, start + hi, NULL) == fn)
+    hi *= 2;
+
+  size_t lo = hi / 2;
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (jit_function_from_pc(ctx, start + mid, NULL) == fn)
+      lo = mid;
+    else
+      hi = mid;
+  }
+
+  return hi;
+}
+
+size_t count_insns(jit_function_t fn) {
+  size_t n = 0;
+  for (jit_block_t block = jit_block_next(fn, NULL); block;
+       block = jit_block_next(fn, block)) {
+    jit_insn_iter_t iter;
+    jit_insn_iter_init(&iter, block);
+    while (jit_insn_iter_next(&iter))
+      n++;
+  }
+
+  return n;
+}
+
+void write_perf_map(void *start, size_t size, char *name) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "/tmp/perf-%d.map", getpid());
+
+  FILE *fp;
+  if (!(fp = fopen(path, "a")))
+    err(EXIT_FAILURE, "%s", path);
+
+  fprintf(fp, "%lx %zx %s\n", (unsigned long) start, size, name);
+
+  if (fclose(fp) == EOF)
+    err(EXIT_FAILURE, "%s", path);
+}
+
+/*
+ * Writes a jitdump file with the code of the program. perf only picks it
+ * up through the executable mapping of the file, so it stays mapped
+ * until exit. Record with `perf record -k 1` and merge with
+ * `perf inject --jit`.
+ */
+void write_jitdump(void *start, size_t size, char *name) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "/tmp/jit-%d.dump", getpid());
+
+  int fd;
+  if ((fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0644)) < 0)
+    err(EXIT_FAILURE, "%s", path);
+
+  long page = sysconf(_SC_PAGESIZE);
+  if (mmap(NULL, page, PROT_READ | PROT_EXEC, MAP_PRIVATE, fd, 0) ==
+      MAP_FAILED)
+    err(EXIT_FAILURE, "%s", path);
+
+  jitdump_header header = {
+    .magic = JITDUMP_MAGIC,
+    .version = JITDUMP_VERSION,
+    .total_size = sizeof(jitdump_header),
+    .elf_mach = JITDUMP_MACH,
+    .pid = getpid(),
+    .timestamp = monotonic_ns(),
+  };
+
+  size_t name_len = strlen(name) + 1;
+  jitdump_code_load record = {
+    .id = JIT_CODE_LOAD,
+    .total_size = sizeof(jitdump_code_load) + name_len + size,
+    .timestamp = monotonic_ns(),
+    .pid = getpid(),
+    .tid = syscall(SYS_gettid),
+    .vma = (uintptr_t) start,
+    .code_addr = (uintptr_t) start,
+    .code_size = size,
+  };
+
+  FILE *fp;
+  if (!(fp = fdopen(fd, "w")))
+    err(EXIT_FAILURE, "%s", path);
+
+  fwrite(&header, sizeof(header), 1, fp);
+  fwrite(&record, sizeof(record), 1, fp);
+  fwrite(name, name_len, 1, fp);
+  fwrite(start, size, 1, fp);
+
+  if (fclose(fp) == EOF)
+    err(EXIT_FAILURE, "%s", path);
+}
+
 void read_file(char *file, char *buffer) {
   int fd;
   if ((fd = open(file, O_RDONLY)) < 0)
@@ -230,9 +477,11 @@ void read_file(char *file, char *buffer) {
 int main(int argc, char *argv[]) {
   progname = basename(argv[0]);
 
-  bool debug_instructions = false;
+  bool debug_instructions = false, perf_map = false, jitdump = false;
+  bool progress = false;
   int opt;
-  if ((opt = getopt_long(argc, argv, "hpv", longopts, NULL)) != -1) {
+  const char *optstring = "C::hjmprS::v";
+  while ((opt = getopt_long(argc, argv, optstring, longopts, NULL)) != -1) {
     switch (opt) {
       case 'h':
         help();
@@ -240,9 +489,25 @@ int main(int argc, char *argv[]) {
       case 'v':
         version();
         exit(EXIT_SUCCESS);
+      case 'C':
+        enable_counters("jit", parse_stats_format(optarg));
+        break;
+      case 'j':
+        jitdump = true;
+        break;
+      case 'm':
+        perf_map = true;
+        break;
       case 'p':
         debug_instructions = true;
         break;
+      case 'r':
+        progress = true;
+        rt_watch_progress();
+        break;
+      case 'S':
+        enable_stats("jit", parse_stats_format(optarg));
+        break;
       default:
         usage(stderr);
         exit(EXIT_FAILURE);
@@ -265,17 +530,47 @@ int main(int argc, char *argv[]) {
       jit_type_create_signature(jit_abi_cdecl, jit_type_void, params, 1, 1);
   jit_function_t program = jit_function_create(ctx, sig);
 
-  compile_bf(program, buffer);
+  PROBE(compile__start);
+  uint64_t start = monotonic_ns();
+  compile_bf(program, buffer, progress);
+  stats.parse = monotonic_ns() - start;
+  stats.ops = count_insns(program);
+
+  start = monotonic_ns();
   jit_function_compile(program);
+  stats.compile = monotonic_ns() - start;
+  PROBE(compile__done);
 
   jit_context_build_end(ctx);
 
-  if (debug_instructions)
+  if (debug_instructions) {
     jit_dump_function(stdout, program, "bf");
+    fflush(stdout);
+  }
 
   uint8_t tape[TAPE_SIZE] = { 0 };
   BF_program fn = jit_function_to_closure(program);
+
+  stats.code_size = code_size(ctx, program, (uint8_t *) fn);
+  if (perf_map || jitdump) {
+    char name[PATH_MAX + 8];
+    snprintf(name, sizeof(name), "bf:%s", argv[optind]);
+
+    size_t size = stats.code_size;
+    if (perf_map)
+      write_perf_map(fn, size, name);
+    if (jitdump)
+      write_jitdump(fn, size, name);
+  }
+
+  PROBE(run__start);
+  start = monotonic_ns();
+  start_counters();
   fn(tape);
+  rt_flush();
+  stop_counters();
+  stats.run = monotonic_ns() - start;
+  PROBE(run__done);
 
 #ifdef DEBUG
   jit_function_abandon(program);
@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2023, Joshua Krusell
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Static tracepoints in the SystemTap SDT format, so that bpftrace, perf
+ * and friends can attach to them as usdt:<binary>:bf:<name> without a
+ * special build. A probe that is not attached costs a single nop, the
+ * rest is an ELF note describing where its arguments live. Arguments are
+ * passed as 64-bit integers.
+ *
+ * <sys/sdt.h> is used when installed. Otherwise x86-64 gets a minimal
+ * equivalent below and other targets compile the probes away.
+ *
+ *   $ bpftrace -e 'usdt:./bf:bf:flush__start { @bytes = hist(arg0); }'
+ */
+
+#ifndef BF_PROBES_H
+#define BF_PROBES_H
+
+#include <stdint.h>
+
+#ifdef __has_include
+#if __has_include(<sys/sdt.h>)
+#define HAVE_SYS_SDT_H
+#endif
+#endif
+
+#if defined(HAVE_SYS_SDT_H)
+#include <sys/sdt.h>
+
+#define PROBE(name) DTRACE_PROBE(bf, name)
+#define PROBE1(name, a) DTRACE_PROBE1(bf, name, (int64_t) (a))
+#define PROBE2(name, a, b)                                                     \
+  DTRACE_PROBE2(bf, name, (int64_t) (a), (int64_t) (b))
+#elif defined(__x86_64__)
+#define PROBE_NOTE(name, args)                                                 \
+  "990: nop\n"                                                                 \
+  ".pushsection .note.stapsdt, \"?\", \"note\"\n"                              \
+  ".balign 4\n"                                                                \
+  ".4byte 992f-991f, 994f-993f, 3\n"                                           \
+  "991: .asciz \"stapsdt\"\n"                                                  \
+  "992: .balign 4\n"                                                           \
+  "993: .8byte 990b, _.stapsdt.base, 0\n"                                      \
+  ".asciz \"bf\"\n"                                                            \
+  ".asciz \"" #name "\"\n"                                                     \
+  ".asciz \"" args "\"\n"                                                      \
+  "994: .balign 4\n"                                                           \
+  ".popsection\n"                                                              \
+  ".ifndef _.stapsdt.base\n"                                                   \
+  ".pushsection .stapsdt.base, \"aG\", \"progbits\", .stapsdt.base, comdat\n"  \
+  ".weak _.stapsdt.base\n"                                                     \
+  ".hidden _.stapsdt.base\n"                                                   \
+  "_.stapsdt.base: .space 1\n"                                                 \
+  ".size _.stapsdt.base, 1\n"                                                  \
+  ".popsection\n"                                                              \
+  ".endif\n"
+
+#define PROBE(name) __asm__ volatile(PROBE_NOTE(name, ""))
+#define PROBE1(name, a)                                                        \
+  __asm__ volatile(PROBE_NOTE(name, "-8@%0")::"nor"((int64_t) (a)))
+#define PROBE2(name, a, b)                                                     \
+  __asm__ volatile(PROBE_NOTE(name, "-8@%0 -8@%1")::"nor"((int64_t) (a)),      \
+                   "nor"((int64_t) (b)))
+#else
+#define PROBE(name)
+#define PROBE1(name, a)
+#define PROBE2(name, a, b)
+#endif
+
+#endif
@@ -0,0 +1,11 @@
+>>>>>>>>>+>>+>+>>>>>>+>>+>+>>>+>>>+>>+>+>>>>>>+>>+>+>>>+>>>+>>+>+>>>>>>+>>+>+>>>
++>>>+>>+>+>>>>>>+>>+>+>>>+>>>+>>+>+>>>>>>+>>+>+>>>+>>>+>>+>+>>>>>>+>>+>+>>>+>>>+
+>>+>+>>>>>>+>>+>+>>>+>>>+>>+>+>>>>>>+>>+>+>>>+>>>+>>+>+>>>>>>+>>+>+>>>+>>>+>>+>+
+>>>>>>+>>+>+>>>+>>>+>>+>+>>>>>>+>>+>+>>>+>>>+<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
+<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
+<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
+<[<<[<<<<<<<<<]>>>>>>>>>>[->>>>>>>>>]+>[->>>>>+>+<<<<<<]>>>>>>[-<<<<<<+>>>>>>]<[
+-++++++++[->++++++++<]>+<<<<[->>>>+<+<<<]>>>[-<<<+>>>]<<[->>>++<+<<]>>[-<<+>>]>.
+[-]<<<[->>+<<]<[->+<]<[->+<]>>>>[-<<<<+>>>>]<[->>+<+<]>[-<+>]>[-<<<[->>+<<]<[->+
+<]<[->+<]>>>>[-<<<<+>>>>]>]<++++++++[->++++++++<]>+<<<<[->>>>+<+<<<]>>>[-<<<+>>>
+]<<[->>>++<+<<]>>[-<<+>>]>.[-]++++++++++.[-]<]<<<<<]
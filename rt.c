@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2023, Joshua Krusell
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "probes.h"
+#include "rt.h"
+
+rt_buffer rt_in, rt_out;
+
+volatile sig_atomic_t rt_progress;
+uint64_t rt_backedges;
+
+void rt_flush(void) {
+  PROBE1(flush__start, rt_out.len);
+
+  ssize_t n;
+  for (size_t i = 0; i < rt_out.len; i += n) {
+    if ((n = write(STDOUT_FILENO, rt_out.data + i, rt_out.len - i)) < 0) {
+      if (errno == EINTR) {
+        n = 0;
+        continue;
+      }
+
+      err(EXIT_FAILURE, "write");
+    }
+
+    // Would otherwise retry forever, aot executables fail the same way
+    if (n == 0)
+      errx(EXIT_FAILURE, "write: output error");
+  }
+
+  rt_out.total += rt_out.len;
+  PROBE1(flush__done, rt_out.len);
+  rt_out.len = 0;
+}
+
+int rt_fill(void) {
+  rt_flush();
+
+  PROBE(fill__start);
+  ssize_t n;
+  while ((n = read(STDIN_FILENO, rt_in.data, RT_BUF_SIZE)) < 0) {
+    if (errno != EINTR)
+      err(EXIT_FAILURE, "read");
+  }
+
+  PROBE1(fill__done, n);
+  if (n == 0)
+    return EOF;
+
+  rt_in.total += n;
+  rt_in.len = n;
+  rt_in.pos = 1;
+  return rt_in.data[0];
+}
+
+// Out-of-line versions for callers that need a function pointer
+int rt_getchar(void) {
+  return rt_get();
+}
+
+int rt_putchar(int c) {
+  rt_put(c);
+  return c;
+}
+
+void request_progress(__attribute__((unused)) int sig) {
+  rt_progress = 1;
+}
+
+void rt_watch_progress(void) {
+  struct sigaction sa = { .sa_handler = request_progress,
+                          .sa_flags = SA_RESTART };
+  sigemptyset(&sa.sa_mask);
+
+  if (sigaction(SIGUSR1, &sa, NULL) < 0)
+    err(EXIT_FAILURE, "sigaction");
+}
+
+// Byte counts are as seen by the program, buffered or not
+void rt_report(size_t pos, ssize_t index) {
+  rt_progress = 0;
+  warnx("at source offset %zu, cell %zd, %" PRIu64 " back edges, "
+        "%zu bytes read, %zu bytes written",
+        pos, index, rt_backedges, rt_in.total - (rt_in.len - rt_in.pos),
+        rt_out.total + rt_out.len);
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2023, Joshua Krusell
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Buffered I/O shared by all engines. The fast paths are inline and
+ * only touch the buffers; rt_flush and rt_fill do the actual system
+ * calls. Reading flushes pending output first so that prompts show up
+ * before a program blocks on input. Nothing is flushed implicitly at
+ * exit, callers must rt_flush() once the program has finished.
+ *
+ * jit and aot emit the same fast paths inline in generated code, so the
+ * layout of rt_buffer is part of their ABI.
+ *
+ * For progress reports, engines count taken loop back edges in
+ * rt_backedges and poll rt_progress next to that. rt_watch_progress()
+ * makes SIGUSR1 set it, and rt_report() then prints a snapshot to stderr
+ * and clears it, without otherwise disturbing the run.
+ */
+
+#ifndef BF_RT_H
+#define BF_RT_H
+
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define RT_BUF_SIZE (1 << 16)
+
+typedef struct {
+  size_t pos, len, total;
+  uint8_t data[RT_BUF_SIZE];
+} rt_buffer;
+
+extern rt_buffer rt_in, rt_out;
+
+extern volatile sig_atomic_t rt_progress;
+extern uint64_t rt_backedges;
+
+void rt_flush(void);
+int rt_fill(void);
+
+int rt_getchar(void);
+int rt_putchar(int c);
+
+void rt_watch_progress(void);
+void rt_report(size_t pos, ssize_t index);
+
+static inline int rt_get(void) {
+  return (rt_in.pos < rt_in.len) ? rt_in.data[rt_in.pos++] : rt_fill();
+}
+
+static inline void rt_put(int c) {
+  rt_out.data[rt_out.len++] = c;
+  if (rt_out.len == RT_BUF_SIZE)
+    rt_flush();
+}
+
+#endif
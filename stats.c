@@ -0,0 +1,225 @@
+/*
+ * Copyright (c) 2023, Joshua Krusell
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <linux/perf_event.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rt.h"
+#include "stats.h"
+
+stats_t stats = {
+  .parse = STATS_NONE,
+  .optimize = STATS_NONE,
+  .compile = STATS_NONE,
+  .run = STATS_NONE,
+  .ops = STATS_NONE,
+  .code_size = STATS_NONE,
+  .tape_high_water = STATS_NONE,
+};
+
+#define CACHE_MISS(cache)                                                      \
+  ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) |                              \
+   (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+#define NUM_COUNTERS 5
+
+static const struct {
+  const char *name;
+  uint32_t type;
+  uint64_t config;
+} events[NUM_COUNTERS] = {
+  {"cycles",         PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES           },
+  { "instructions",  PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS         },
+  { "branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES        },
+  { "l1d_misses",    PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_L1D)},
+  { "llc_misses",    PERF_TYPE_HW_CACHE, CACHE_MISS(PERF_COUNT_HW_CACHE_LL) },
+};
+
+static int counter_fds[NUM_COUNTERS] = { -1, -1, -1, -1, -1 };
+static int64_t counter_values[NUM_COUNTERS] = {
+  STATS_NONE, STATS_NONE, STATS_NONE, STATS_NONE, STATS_NONE,
+};
+
+static const char *stats_engine;
+static stats_format stats_output;
+static bool show_stats, show_counters;
+
+uint64_t monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+stats_format parse_stats_format(char *s) {
+  if (!s || !strcmp(s, "text"))
+    return STATS_TEXT;
+  if (!strcmp(s, "json"))
+    return STATS_JSON;
+
+  errx(EXIT_FAILURE, "Invalid stats format: %s", s);
+}
+
+void print_field(const char *name, int64_t value, bool json) {
+  if (json)
+    fprintf(stderr, ", \"%s\": ", name);
+  else
+    fprintf(stderr, "%-16s", name);
+
+  if (value == STATS_NONE)
+    fputs(json ? "null" : "-", stderr);
+  else
+    fprintf(stderr, "%" PRId64, value);
+
+  if (!json)
+    fputc('\n', stderr);
+}
+
+void print_stats(void) {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) < 0)
+    err(EXIT_FAILURE, "getrusage");
+
+  // As seen by the program, not counting input still in the buffer
+  size_t bytes_read = rt_in.total - (rt_in.len - rt_in.pos);
+  size_t bytes_written = rt_out.total + rt_out.len;
+
+  struct {
+    const char *name;
+    int64_t value;
+  } fields[] = {
+    {"parse_ns",         stats.parse                     },
+    { "optimize_ns",     stats.optimize                  },
+    { "compile_ns",      stats.compile                   },
+    { "run_ns",          stats.run                       },
+    { "ops",             stats.ops                       },
+    { "code_size",       stats.code_size                 },
+    { "peak_rss",        (int64_t) usage.ru_maxrss * 1024},
+    { "tape_high_water", stats.tape_high_water           },
+    { "bytes_read",      (int64_t) bytes_read            },
+    { "bytes_written",   (int64_t) bytes_written         },
+  };
+
+  bool json = stats_output == STATS_JSON;
+  if (json)
+    fprintf(stderr, "{\"engine\": \"%s\"", stats_engine);
+  else
+    fprintf(stderr, "%-16s%s\n", "engine", stats_engine);
+
+  if (show_stats)
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++)
+      print_field(fields[i].name, fields[i].value, json);
+
+  if (show_counters)
+    for (size_t i = 0; i < NUM_COUNTERS; i++)
+      print_field(events[i].name, counter_values[i], json);
+
+  if (json)
+    fprintf(stderr, "}\n");
+}
+
+// Both reports go out together in the last requested format
+void register_report(const char *engine, stats_format format) {
+  bool registered = show_stats || show_counters;
+
+  stats_engine = engine;
+  stats_output = format;
+
+  if (!registered && atexit(print_stats))
+    errx(EXIT_FAILURE, "Unable to register --stats");
+}
+
+void enable_stats(const char *engine, stats_format format) {
+  register_report(engine, format);
+  show_stats = true;
+}
+
+/*
+ * Counters are opened disabled and individually rather than as a group,
+ * so that one unsupported event, typically a cache event in a VM, does
+ * not take the others down with it. User space only, which also works
+ * under the default perf_event_paranoid setting.
+ */
+void enable_counters(const char *engine, stats_format format) {
+  register_report(engine, format);
+  show_counters = true;
+
+  int failed = 0, errnum = 0;
+  for (size_t i = 0; i < NUM_COUNTERS; i++) {
+    struct perf_event_attr attr = {
+      .type = events[i].type,
+      .size = sizeof(attr),
+      .config = events[i].config,
+      .read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                     PERF_FORMAT_TOTAL_TIME_RUNNING,
+      .disabled = 1,
+      .exclude_kernel = 1,
+      .exclude_hv = 1,
+    };
+
+    if ((counter_fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1,
+                                  PERF_FLAG_FD_CLOEXEC)) < 0) {
+      failed++;
+      errnum = errno;
+    }
+  }
+
+  if (failed == NUM_COUNTERS)
+    warnx("No hardware counters available: %s", strerror(errnum));
+}
+
+void start_counters(void) {
+  for (size_t i = 0; i < NUM_COUNTERS; i++) {
+    if (counter_fds[i] < 0)
+      continue;
+
+    ioctl(counter_fds[i], PERF_EVENT_IOC_RESET, 0);
+    ioctl(counter_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+  }
+}
+
+// Scales for multiplexing when the PMU had more events than registers
+void stop_counters(void) {
+  for (size_t i = 0; i < NUM_COUNTERS; i++) {
+    if (counter_fds[i] < 0)
+      continue;
+
+    ioctl(counter_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+
+    uint64_t values[3];
+    if (read(counter_fds[i], values, sizeof(values)) != sizeof(values) ||
+        values[2] == 0)
+      continue;
+
+    counter_values[i] = (double) values[0] * values[1] / values[2];
+  }
+}
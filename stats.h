@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2023, Joshua Krusell
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE
+ * LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION
+ * OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ * WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Statistics for --stats. Engines fill in the global `stats` as they go
+ * and enable_stats() arranges for it to be printed to stderr at exit,
+ * together with the peak RSS and the byte counts of the buffered
+ * runtime. Durations are in nanoseconds and sizes in bytes. Whatever an
+ * engine does not measure stays STATS_NONE and is printed as null in
+ * JSON and as "-" in text.
+ *
+ * --perf-counters adds hardware counters read with perf_event_open(2)
+ * between start_counters() and stop_counters(), which engines put
+ * around the run only. Counters the machine or the kernel does not
+ * provide are STATS_NONE as well.
+ */
+
+#ifndef BF_STATS_H
+#define BF_STATS_H
+
+#include <stdint.h>
+
+#define STATS_NONE -1
+
+typedef enum { STATS_TEXT, STATS_JSON } stats_format;
+
+typedef struct {
+  int64_t parse, optimize, compile, run;
+  int64_t ops, code_size, tape_high_water;
+} stats_t;
+
+extern stats_t stats;
+
+uint64_t monotonic_ns(void);
+
+stats_format parse_stats_format(char *s);
+void enable_stats(const char *engine, stats_format format);
+
+void enable_counters(const char *engine, stats_format format);
+void start_counters(void);
+void stop_counters(void);
+
+#endif
@@ -0,0 +1,86 @@
+#!/usr/bin/env python3
+"""Regression tests run by make check.
+
+Every case runs on each engine that is built, like bench.py, and
+engines that are not built are skipped.
+"""
+
+import os
+import subprocess
+import sys
+import tempfile
+import unittest
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.dirname(
+    os.path.abspath(__file__))), "bench"))
+import bench  # noqa: E402
+
+# name: (source, input, expected output)
+CASES = {
+    # A leading comment loop that never runs but moves left of cell 0
+    "dead-comment-left": ("[<<+>>-]++++++++[>++++++++<-]>+.", b"", b"A"),
+    "hello": (open(os.path.join(bench.PROGRAMS, "hello.bf")).read(), b"",
+              b"Hello World!"),
+}
+
+
+class Engines(unittest.TestCase):
+    def setUp(self):
+        self.dir = tempfile.TemporaryDirectory(prefix="check")
+        self.addCleanup(self.dir.cleanup)
+
+    def run_case(self, engine, name):
+        source, stdin, expected = CASES[name]
+        path = os.path.join(self.dir.name, name + ".bf")
+        with open(path, "w") as f:
+            f.write(source)
+
+        cmd = engine.prepare(path, self.dir.name)
+        p = subprocess.run(cmd, input=stdin, capture_output=True,
+                           preexec_fn=bench.unlimit_stack)
+        self.assertEqual(p.returncode, 0, p.stderr.decode())
+        self.assertEqual(p.stdout, expected)
+
+    def test_cases(self):
+        for engine in bench.ENGINES:
+            for name in CASES:
+                with self.subTest(engine=engine.name, case=name):
+                    if not engine.available():
+                        self.skipTest(f"./{engine.binary} is not built")
+                    self.run_case(engine, name)
+
+    def test_write_error(self):
+        path = os.path.join(bench.PROGRAMS, "hello.bf")
+        for engine in bench.ENGINES:
+            with self.subTest(engine=engine.name):
+                if not engine.available():
+                    self.skipTest(f"./{engine.binary} is not built")
+
+                cmd = engine.prepare(path, self.dir.name)
+                with open("/dev/full", "wb") as full:
+                    p = subprocess.run(cmd, stdout=full,
+                                       stderr=subprocess.PIPE,
+                                       preexec_fn=bench.unlimit_stack)
+                self.assertNotEqual(p.returncode, 0)
+
+    def test_batch_duplicate_outputs(self):
+        if not os.access(bench.bin_path("aot"), os.X_OK):
+            self.skipTest("./aot is not built")
+
+        inputs = []
+        for sub in ("a", "b"):
+            os.mkdir(os.path.join(self.dir.name, sub))
+            inputs.append(os.path.join(self.dir.name, sub, "x.bf"))
+            with open(inputs[-1], "w") as f:
+                f.write(CASES["dead-comment-left"][0])
+
+        outdir = os.path.join(self.dir.name, "out")
+        p = subprocess.run([bench.bin_path("aot"), "-j", "2", "-D", outdir]
+                           + inputs, capture_output=True)
+        self.assertNotEqual(p.returncode, 0)
+        self.assertIn(b"Several inputs", p.stderr)
+        self.assertFalse(os.path.exists(os.path.join(outdir, "x")))
+
+
+if __name__ == "__main__":
+    unittest.main()